@@ -13,6 +13,7 @@ typedef struct lk_Buffer {
     size_t size;
     size_t capacity;
     lk_State *S;
+    int istmp; /* overflow storage from lk_tmpalloc() */
     char *buff;
     char init_buff[LK_BUFFERSIZE];
 } lk_Buffer;
@@ -23,8 +24,9 @@ typedef struct lk_Buffer {
 #define lk_addchar(B,ch)  (*lk_prepbuffsize((B), 1) = (ch), ++(B)->size)
 #define lk_addstring(B,s) lk_addlstring((B),(s),strlen(s))
 
-LK_API void lk_initbuffer (lk_State *S, lk_Buffer *b);
-LK_API void lk_freebuffer (lk_Buffer *b);
+LK_API void lk_initbuffer    (lk_State *S, lk_Buffer *b);
+LK_API void lk_inittmpbuffer (lk_State *S, lk_Buffer *b);
+LK_API void lk_freebuffer    (lk_Buffer *b);
 
 LK_API char *lk_prepbuffsize (lk_Buffer *B, size_t len);
 
@@ -52,14 +54,23 @@ LK_NS_BEGIN
 LK_API void lk_initbuffer (lk_State *S, lk_Buffer *B) {
     B->size = 0;
     B->S = S;
+    B->istmp = 0;
     B->capacity = LK_BUFFERSIZE;
     B->buff = B->init_buff;
 }
 
+/* overflow storage is only valid until the current dispatch ends */
+LK_API void lk_inittmpbuffer (lk_State *S, lk_Buffer *B) {
+    lk_initbuffer(S, B);
+    B->istmp = 1;
+}
+
 LK_API void lk_freebuffer (lk_Buffer *B) {
-    if (B->buff != B->init_buff)
+    int istmp = B->istmp;
+    if (B->buff != B->init_buff && !istmp)
         lk_free(B->S, B->buff, B->capacity);
     lk_initbuffer(B->S, B);
+    B->istmp = istmp;
 }
 
 LK_API char *lk_prepbuffsize (lk_Buffer *B, size_t len) {
@@ -68,11 +79,14 @@ LK_API char *lk_prepbuffsize (lk_Buffer *B, size_t len) {
         size_t newsize = LK_BUFFERSIZE;
         while (newsize < B->size + len && newsize < ~(size_t)0/2)
             newsize *= 2;
-        if (B->buff != B->init_buff)
+        if (B->istmp && (newptr = lk_tmpalloc(B->S, newsize)) != NULL)
+            memcpy(newptr, B->buff, B->size);
+        else if (B->buff != B->init_buff && !B->istmp)
             newptr = lk_realloc(B->S, B->buff, newsize, B->capacity);
         else {
             newptr = lk_malloc(B->S, newsize);
             memcpy(newptr, B->buff, B->size);
+            B->istmp = 0; /* no arena in this thread: own the storage */
         }
         B->buff = (char*)newptr;
         B->capacity = newsize;
@@ -46,9 +46,13 @@
 #define LK_WEAK    (1)
 #define LK_ERR     (-1)
 #define LK_TIMEOUT (-2)
+#define LK_BUSY    (-3)
+#define LK_QUOTA   (-4)
 
 #define LK_TYPE_MASK     ((unsigned)0x3FFFFFFF)
+#define LK_URGENT_TYPE   ((unsigned)0x40000000)
 #define LK_RESPONSE_TYPE ((unsigned)0x80000000)
+#define LK_UNBLOCK_TYPE  LK_TYPE_MASK /* signals on LK_SLOTNAME_UNBLOCK */
 
 #ifndef LK_SLOTNAME_LAUNCH
 # define LK_SLOTNAME_LAUNCH "on_service_launch"
@@ -58,6 +62,10 @@
 # define LK_SLOTNAME_CLOSE "on_service_close"
 #endif
 
+#ifndef LK_SLOTNAME_UNBLOCK
+# define LK_SLOTNAME_UNBLOCK "on_unblock"
+#endif
+
 LK_NS_BEGIN
 
 
@@ -75,8 +83,8 @@ struct lk_Source {
     lk_Handler *callback;
     lk_Handler *deletor;
     void       *ud;
-    unsigned    refcount : 31;
-    unsigned    force    : 1; /* call source even in req signal */
+    long        refcount;
+    unsigned    force : 1; /* call source even in req signal */
 };
 
 struct lk_Signal {
@@ -85,6 +93,10 @@ struct lk_Signal {
     unsigned    type   : 30;
     unsigned    isdata : 1;  /* data is lk_Data* */
     unsigned    isack  : 1;  /* this is a response signal */
+    unsigned    isinline : 1; /* data is copied into the signal node */
+    unsigned    isurgent : 1; /* handled ahead of queued signals */
+    unsigned    ttl      : 24; /* ms before it is dropped, 0: never,
+                                  at most LK_MAX_TTL */
 };
 
 
@@ -119,18 +131,85 @@ LK_API int lk_broadcast (lk_State *S, const char *slot, const lk_Signal *sig);
 
 LK_API lk_Service *lk_self (lk_State *S);
 
+/* a service is charged for what it allocates, and credited when that is
+ * freed, by any service; the pages of a pool are charged to the service
+ * that filled it while empty. signals queued for it are charged to it too.
+ * Over its quota, h is told once; without h, emits to the service fail
+ * with LK_QUOTA until it is back under */
+typedef void lk_QuotaHandler (lk_State *S, void *ud, lk_Service *svr, size_t used);
+
+LK_API size_t lk_memused  (lk_Service *svr);
+LK_API size_t lk_mempeak  (lk_Service *svr);
+LK_API void   lk_setquota (lk_Service *svr, size_t quota, lk_QuotaHandler *h, void *ud);
+
+/* a dispatch handles at most "loki.budget.signals" signals and runs for
+ * at most "loki.budget.ns" nanoseconds before the service is requeued;
+ * append ".<service>" to a key to override it for one service */
+LK_API size_t lk_exhausted (lk_Service *svr);
+
+/* workers run higher classes first; a service waiting longer than
+ * "loki.priority.aging" ms runs ahead of them anyway. the class of a
+ * service is "loki.priority.<service>" when it starts */
+#define LK_PRIORITY_HIGH    0
+#define LK_PRIORITY_NORMAL  1
+#define LK_PRIORITY_LOW     2
+#define LK_PRIORITIES       3
+
+LK_API int    lk_setpriority (lk_Service *svr, int priority);
+
+/* a bounded mailbox refuses signals with LK_BUSY from "loki.mailbox.high"
+ * queued signals until it drains to "loki.mailbox.low"; then services it
+ * refused get an urgent LK_UNBLOCK_TYPE signal on their LK_SLOTNAME_UNBLOCK
+ * slot, with the drained service as data, or NULL if it closed */
+LK_API void   lk_setmailbox  (lk_Service *svr, unsigned high, unsigned low);
+
+/* time services of a class waited in run queues, kept only when
+ * "loki.waitstats" is set */
+LK_API size_t lk_waitstats   (lk_State *S, int priority, size_t *avg_ns, size_t *max_ns);
+
+/* handlers of a coroutine service ("loki.coroutine") run on small stacks
+ * of "loki.stacksize" bytes, so lk_wait in one suspends only that handler
+ * and the worker goes on with other signals */
+LK_API int    lk_setcoroutine (lk_Service *svr, int enable);
+
 
 /* message routines */
 
-#define LK_SIGNAL             { NULL, NULL, 0, 0, 0 }
-#define LK_RESPONSE           { NULL, NULL, 0, 0, 1 }
+#define LK_SIGNAL             { NULL, NULL, 0, 0, 0, 0, 0, 0 }
+#define LK_RESPONSE           { NULL, NULL, 0, 0, 1, 0, 0, 0 }
+#define LK_MAX_TTL            0x7FFFFF /* ms, about two hours */
+#define LK_INLINE_SIZE        48 /* largest payload lk_emitinline copies */
 #define lk_serviceslot(slot)  ((lk_Slot*)lk_service((lk_Slot*)(slot)))
 
 LK_API lk_Slot *lk_newslot (lk_State *S, const char *name, lk_Handler *h, void *ud);
+
+/* a batch slot gets runs of queued signals in one call; responses and
+ * signals with a source come one at a time. A handler that returns k in
+ * 1..n-1 has handled only the first k signals, the rest come again first
+ * on the next dispatch; LK_OK or any other value means all of them */
+typedef struct lk_BatchSignal {
+    lk_Slot   *sender;
+    lk_Signal  data;
+} lk_BatchSignal;
+
+typedef int lk_BatchHandler (lk_State *S, lk_BatchSignal *sigs, int n);
+
+LK_API lk_Slot *lk_newbatchslot (lk_State *S, const char *name, lk_BatchHandler *h, void *ud);
 LK_API lk_Slot *lk_newpoll (lk_State *S, const char *name, lk_Handler *h, void *ud);
+
+/* an event poll has no thread of its own: h runs on a shared poll worker
+ * for each signal, with (poll, NULL) when its timeout passes and with
+ * (NULL, NULL) when it closes. h must not block; what it returns is the
+ * next timeout in ms, <= 0 for none */
+LK_API lk_Slot *lk_neweventpoll (lk_State *S, const char *name, lk_Handler *h, void *ud);
 LK_API lk_Slot *lk_slot    (lk_State *S, const char *name);
 LK_API lk_Slot *lk_current (lk_State *S);
 
+LK_API size_t lk_expired (lk_Slot *slot); /* signals dropped for their ttl */
+
+/* a poll waits for its next signal; a handler of a coroutine service
+ * waits for the next response to its slot, or only sleeps if sig is NULL.
+ * Either way the signal handled so far is done with */
 LK_API int lk_wait (lk_State *S, lk_Signal *sig, int waitms);
 
 LK_API void lk_initsource  (lk_State *S, lk_Source *src, lk_Handler *h, void *ud);
@@ -138,12 +217,35 @@ LK_API void lk_usesource   (lk_Source *src);
 LK_API void lk_freesource  (lk_Source *src);
 LK_API void lk_setcallback (lk_State *S, lk_Handler *h, void *ud);
 
+/* a call is a request whose reply comes back to h in the calling service,
+ * or h(S, NULL, sig) comes if no reply is there within timeout_ms (<= 0:
+ * no limit) or the service closes first. Either way sig->source->ud is
+ * ud. The responder sends the request signal back with isack set, so
+ * that it keeps the source which matches it to the call. Without h, a
+ * coroutine handler waits in lk_call: it gets the reply in *sig and
+ * LK_OK, or LK_TIMEOUT. Like other responses, the reply goes through the
+ * refactor of the replying slot first, but reaches the call anyway */
+LK_API int lk_call (lk_Slot *slot, lk_Signal *sig, int timeout_ms, lk_Handler *h, void *ud);
+
 LK_API int  lk_emit        (lk_Slot *slot, const lk_Signal *sig);
 LK_API int  lk_emitstring  (lk_Slot *slot, unsigned type, const char *s);
+LK_API int  lk_emitinline  (lk_Slot *slot, unsigned type, const void *p, size_t len);
+LK_API int  lk_emiturgent  (lk_Slot *slot, const lk_Signal *sig);
+LK_API int  lk_emitwait    (lk_Slot *slot, const lk_Signal *sig, int waitms);
+LK_API int  lk_emitn       (lk_Slot *slot, const lk_Signal *sigs, int n);
+LK_API int  lk_emitv       (lk_State *S, const lk_Slot **slots, const lk_Signal *sigs, int n);
 
 LK_API void lk_sethook (lk_Slot *slot, lk_Handler *h, void *ud);
 LK_API void lk_setdata (lk_Slot *slot, void *data);
 
+/* a signal emitted to a conflating slot replaces the payload of a queued
+ * one with the same type and key, keeping its place in the mailbox; the
+ * key function of a conflating slot changes only while none is queued
+ * there, LK_ERR otherwise */
+typedef size_t lk_ConflateKey (const lk_Signal *sig);
+
+LK_API int  lk_setconflate (lk_Slot *slot, lk_ConflateKey *keyf);
+
 LK_API void *lk_data (lk_Slot *slot);
 
 LK_API const char *lk_name    (lk_Slot *slot);
@@ -172,6 +274,8 @@ LK_NS_BEGIN
 
 
 #define LK_MPOOLPAGESIZE 4096
+#define LK_HUGEPAGESIZE  (2u<<20)
+#define LK_POOL_HUGEPAGE 0x01 /* map pages from the OS, huge if possible */
 
 /* memory management */
 
@@ -187,17 +291,43 @@ typedef struct lk_MemPool {
     void  *pages;
     void  *freed;
     size_t size;
+    size_t pagesize;
+    size_t npages;
+    size_t nobjs;
+    size_t nfree;
+    size_t reserve; /* free objects trimming leaves alone */
+    unsigned flags;
+    lk_Service *owner; /* charged for the pages */
     LK_DEBUG_POOL(size_t allocated;)
 } lk_MemPool;
 
 LK_API void *lk_malloc    (lk_State *S, size_t size);
 LK_API void *lk_realloc   (lk_State *S, void *ptr, size_t size, size_t osize);
 LK_API void  lk_free      (lk_State *S, void *ptr, size_t osize);
+LK_API void *lk_tmpalloc  (lk_State *S, size_t size);
 LK_API void  lk_initpool  (lk_MemPool *mpool, size_t size);
 LK_API void  lk_freepool  (lk_State *S, lk_MemPool *mpool);
 LK_API void *lk_poolalloc (lk_State *S, lk_MemPool *mpool);
 LK_API void  lk_poolfree  (lk_MemPool *mpool, void *obj);
 
+LK_API void lk_poolreserve (lk_State *S, lk_MemPool *mpool, size_t count);
+LK_API int  lk_reserve     (lk_State *S, int kind, size_t count);
+
+#define LK_RESERVE_SERVICES   0
+#define LK_RESERVE_SLOTS      1
+#define LK_RESERVE_POLLS      2
+#define LK_RESERVE_DEFERS     3
+#define LK_RESERVE_SIGNALS    4
+#define LK_RESERVE_SOURCES    5
+#define LK_RESERVE_PIECES     6 /* + size: pieces of lk_malloc(S, size) */
+#define LK_RESERVE_PIECE(size) (LK_RESERVE_PIECES + (int)(size))
+
+LK_API int lk_setpoolpage (lk_MemPool *mpool, size_t pagesize, unsigned flags);
+LK_API int lk_setpagesize (lk_State *S, size_t pagesize, unsigned flags);
+
+LK_API size_t lk_trimpool  (lk_State *S, lk_MemPool *mpool, size_t keep);
+LK_API size_t lk_trimpools (lk_State *S);
+
 
 /* string routines */
 
@@ -298,6 +428,7 @@ typedef HANDLE            lk_Thread;
 #include <limits.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 
 typedef pthread_key_t     lk_TlsKey;
 typedef pthread_mutex_t   lk_Lock;
@@ -323,6 +454,67 @@ typedef pthread_t         lk_Thread;
 
 #endif
 
+/* atomic operations: integer ones work on `long`, pointer ones on `void*`
+ * sized fields; everything but load/store is a full barrier */
+
+#if defined(__ATOMIC_SEQ_CST) /* GCC 4.7+ and clang: C11 memory model */
+# define lk_atomicload(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define lk_atomicstore(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define lk_atomicxchg(p,v)    __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+# define lk_atomiccas(p,e,v)   __sync_bool_compare_and_swap((p), (e), (v))
+# define lk_atomicadd(p,v)     __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+# define lk_atomicloadp        lk_atomicload
+# define lk_atomicstorep       lk_atomicstore
+# define lk_atomicxchgp        lk_atomicxchg
+# define lk_atomiccasp         lk_atomiccas
+
+#elif defined(__GNUC__) /* old GCC: legacy __sync builtins */
+# define lk_atomicload(p)      __sync_fetch_and_add((p), 0)
+# define lk_atomicstore(p,v)   ((void)lk_atomicxchg((p), (v)))
+# define lk_atomicxchg(p,v)    (__sync_synchronize(), \
+                                __sync_lock_test_and_set((p), (v)))
+# define lk_atomiccas(p,e,v)   __sync_bool_compare_and_swap((p), (e), (v))
+# define lk_atomicadd(p,v)     __sync_add_and_fetch((p), (v))
+# define lk_atomicloadp(p)     __sync_val_compare_and_swap((p), NULL, NULL)
+# define lk_atomicstorep       lk_atomicstore
+# define lk_atomicxchgp        lk_atomicxchg
+# define lk_atomiccasp         lk_atomiccas
+
+#elif defined(_WIN32)
+# define lk_atomicload(p)      InterlockedCompareExchange((LONG volatile*)(p), 0, 0)
+# define lk_atomicstore(p,v)   ((void)InterlockedExchange((LONG volatile*)(p), (v)))
+# define lk_atomicxchg(p,v)    InterlockedExchange((LONG volatile*)(p), (v))
+# define lk_atomiccas(p,e,v)   \
+    (InterlockedCompareExchange((LONG volatile*)(p), (v), (e)) == (e))
+# define lk_atomicadd(p,v)     \
+    (InterlockedExchangeAdd((LONG volatile*)(p), (v)) + (v))
+# define lk_atomicloadp(p)     \
+    InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+# define lk_atomicstorep(p,v)  \
+    ((void)InterlockedExchangePointer((PVOID volatile*)(p), (v)))
+# define lk_atomicxchgp(p,v)   \
+    InterlockedExchangePointer((PVOID volatile*)(p), (v))
+# define lk_atomiccasp(p,e,v)  \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (v), (e)) == (e))
+
+#else
+# error "loki needs atomic operations on this compiler"
+#endif
+
+#define lk_atomicinc(p) lk_atomicadd((p), 1)
+#define lk_atomicdec(p) lk_atomicadd((p), -1)
+
+/* a hint inside spin loops, so the sibling hyperthread gets the core */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define lk_cpurelax()  __asm__ __volatile__ ("pause")
+#elif defined(__GNUC__) && defined(__aarch64__)
+# define lk_cpurelax()  __asm__ __volatile__ ("yield")
+#elif defined(_WIN32)
+# define lk_cpurelax()  YieldProcessor()
+#else
+# define lk_cpurelax()  ((void)0)
+#endif
+
 LK_NS_BEGIN
 
 
@@ -430,23 +622,66 @@ LK_NS_END
 
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
+
+#if defined(LK_NO_COROUTINE)
+#elif defined(_WIN32)
+# define LK_COROUTINE_FIBER
+#elif defined(__GNUC__) && !defined(LK_USE_UCONTEXT) \
+    && (defined(__x86_64__) || defined(__aarch64__))
+# define LK_COROUTINE_ASM
+#else
+# define LK_COROUTINE_UCONTEXT
+# include <ucontext.h>
+#endif
+
+/* nanoseconds; an unsigned long wraps in 4 s where it is 32 bits */
+#if defined(_MSC_VER)
+typedef unsigned __int64 lk_Nanotime;
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long lk_Nanotime;
+#else
+typedef unsigned long lk_Nanotime;
+#endif
+
 
 #ifndef LK_NAME
 # define LK_NAME "root"
 #endif /* LK_NAME */
 
 #define LK_MAX_THREADS     32
+#define LK_MAX_POLLERS     16
+#define LK_POLLERS         2 /* default "loki.pollers" */
+#define LK_GLOBAL_TICK     61
+#define LK_RUNNEXT_LIMIT   8 /* runnext dispatches before the queue's turn */
+#define LK_BATCH_MAX       1024 /* signals in one lk_BatchHandler call */
+#define LK_BATCH_BYTES     (LK_BATCH_MAX * \
+        (sizeof(lk_BatchSignal) + sizeof(struct lk_SignalNode*)))
+#define LK_MAGAZINE_SIZE   64
 #define LK_MAX_NAMESIZE    32
 #define LK_MAX_SLOTNAME    63
 #define LK_HASHLIMIT       5
 #define LK_MIN_HASHSIZE    8
 #define LK_MAX_SIZET       (~(size_t)0u - 100)
 #define LK_MAX_DATASIZE    ((size_t)(1<<24)-100)
-#define LK_SMALLPIECE_LEN (sizeof(lk_Entry)*LK_MIN_HASHSIZE)
+#define LK_SMALLPIECE_LEN  4096 /* largest size class */
+#define LK_SIZECLASSES     12
+#define LK_MAGAZINE_BYTES  16384
+#define LK_ARENA_CHUNK     16384
+#define LK_OUTBOX_SIZE     256 /* buffered emits before an early flush */
+#define LK_STACK_SIZE      65536 /* default "loki.stacksize" */
+#define LK_MIN_STACKSIZE   16384
+#define LK_MAX_FREESTACKS  256 /* idle coroutines kept for reuse */
+#define LK_SPIN_US         50 /* default "loki.spin", 0 on one cpu */
+#define LK_SPIN_CHECK      32 /* spins between looks at the clock */
+#define LK_SPIN_FLOOR      16 /* a worker spins at least spin/16 */
 
 LK_NS_BEGIN
 
@@ -462,6 +697,12 @@ typedef struct lk_SignalNode {
     lk_Signal      data;
 } lk_SignalNode;
 
+typedef struct lk_Mailbox {
+    lk_SignalNode *head; /* last pushed, swapped by senders */
+    lk_SignalNode *tail; /* next to pop, only touched by the consumer */
+    lk_SignalNode  stub;
+} lk_Mailbox;
+
 struct lk_Slot {
     char           name[LK_MAX_SLOTNAME];
     unsigned char  flags;
@@ -469,42 +710,212 @@ struct lk_Slot {
     lk_Service    *service;
     void          *userdata;
     lk_Handler    *handler;
+    lk_BatchHandler *batchf;  /* instead of handler in batch slots */
     lk_Handler    *refactor;
     lk_Handler    *hookf;
     void          *hook_ud;
     lk_Source     *source;
     lk_SignalNode *current;
+    long           nexpired;
+    struct lk_Conflate *conflate; /* queued signals by (type, key) */
+    struct lk_Coroutine *waiting; /* handlers in lk_wait for a response */
     lkQ_entry(lk_Slot); /* all slots in same service */
 };
 
+typedef struct lk_ConflateEntry {
+    size_t         key;
+    lk_SignalNode *node; /* NULL: unused */
+} lk_ConflateEntry;
+
+typedef struct lk_Conflate {
+    lk_Lock        lock;
+    lk_ConflateKey *keyf;
+    lk_ConflateEntry *entries; /* open addressing, linear probing */
+    size_t         size;
+    size_t         count;
+} lk_Conflate;
+
+typedef struct lk_Timer {
+    unsigned       deadline; /* lkT_clock() */
+    unsigned       index;    /* heap position plus one, 0: not armed */
+    void         (*h) (lk_State *S, struct lk_Timer *t);
+} lk_Timer;
+
+typedef struct lk_ArenaChunk {
+    struct lk_ArenaChunk *next;
+    size_t         size;
+} lk_ArenaChunk;
+
+typedef struct lk_Arena { /* bump allocator, reset after each dispatch */
+    lk_ArenaChunk *chunks;
+    char          *cur;
+    char          *end;
+} lk_Arena;
+
+typedef struct lk_Coroutine {
+#if defined(LK_COROUTINE_FIBER)
+    void          *fiber;
+    void          *caller;
+#elif defined(LK_COROUTINE_UCONTEXT)
+    ucontext_t     uc;
+    ucontext_t     caller;
+#else
+    void          *sp;     /* saved by lkR_switch while switched out */
+    void          *caller; /* worker stack that runs it */
+#endif
+    char          *stack;  /* the mapping, guard page first */
+    size_t         size;
+    lk_State      *S;
+    struct lk_Coroutine *prev, *next; /* in a wait list or the free list */
+    struct lk_Coroutine **list;
+    lk_SignalNode *node;   /* signal handled, then the one lk_wait got */
+    lk_Signal      sig;    /* what the handler got */
+    lk_Arena       arena;  /* lk_tmpalloc, kept while it is suspended */
+    lk_Timer       timer;
+    long           nwakeups; /* timeouts still in the mailbox */
+    unsigned       seq;    /* of the lk_wait a timeout belongs to */
+    int            state;
+    int            timed;
+    int            ret;    /* for lk_wait */
+    lk_Context     ctx;
+} lk_Coroutine;
+
+typedef struct lk_Call {
+    lk_Source      src;     /* the request and its reply carry it */
+    lk_Timer       timer;
+    struct lk_Call *next, **pprev; /* in the pending calls of the service */
+    lk_Slot       *slot;    /* that made the call */
+    lk_Handler    *h;
+    lk_Coroutine  *co;      /* waiting in lk_call, if h is NULL */
+    int            pending;
+    int            timed;
+} lk_Call;
+
 struct lk_Poll {
     lk_Slot        slot;
     lk_Thread      thread;
     lk_Event       event;
     lk_Lock        lock;
     lkQ_type(lk_SignalNode) signals;
+    lk_Timer       timer;     /* event polls: the timeout */
+    struct lk_Poll *next_ready;
+    int            scheduled; /* ready or running, set under both locks */
+    int            running;   /* under poller_lock */
+    int            timedout;
 };
 
 struct lk_Service {
     lk_Slot        slot;
     lk_Slot       *slots;
     lk_Lock        lock;
-    unsigned       pending;
+    long           pending;
+    long           scheduled; /* in a run queue or being dispatched */
+    long           memused;   /* bytes charged to this service */
+    long           mempeak;
+    long           orphan;    /* deleted, freed with its last charged byte */
+    long           memquota;  /* 0: no quota */
+    lk_QuotaHandler *quotaf;  /* NULL: reject emits while over quota */
+    void          *quota_ud;
+    unsigned       budget;    /* signals per dispatch, 0: unlimited */
+    unsigned long  budget_ns; /* time per dispatch, 0: unlimited */
+    long           nexhausted;
+    int            priority;
+    lk_Nanotime    queued;    /* lkT_nanoclock() when scheduled */
     lkQ_entry(lk_Service);
-    lkQ_type(lk_SignalNode) signals;
+    lkQ_type(lk_SignalNode) backlog; /* fetched but out of time */
+    lk_Mailbox     mailbox;
+    lk_Mailbox     express;   /* urgent signals, drained first */
+    long           nqueued;   /* signals in the mailboxes */
+    long           full;      /* refusing signals until drained to low */
+    unsigned       mailbox_high; /* 0: unbounded */
+    unsigned       mailbox_low;
+    lk_Service   **refused;   /* senders told LK_BUSY */
+    unsigned       nrefused;
+    unsigned       refused_size;
+    struct lk_EmitWaiter *waiters; /* senders blocked in lk_emitwait */
+    int            coroutine; /* handlers run in coroutines */
+    unsigned       nsuspended;
+    lk_Coroutine  *sleeping;  /* in lk_wait without a signal */
+    lk_Call       *calls;     /* pending, until a reply or timeout */
+    unsigned       ncalls;
 };
 
+typedef struct lk_EmitWaiter {
+    struct lk_EmitWaiter *next;
+    lk_Event       event;
+} lk_EmitWaiter;
+
+typedef struct lk_Magazine {
+    unsigned       count;
+    unsigned       limit;
+    void          *objs[LK_MAGAZINE_SIZE];
+} lk_Magazine;
+
+typedef struct lk_Cache { /* per-thread objects in front of the pools */
+    lk_Magazine    defers;
+    lk_Magazine    signals;
+    lk_Magazine    sources;
+    lk_Magazine    calls;
+    lk_Magazine    smallpieces[LK_SIZECLASSES];
+    lk_Arena       arena;
+    struct lk_SignalNode **outbox; /* emits buffered during a dispatch */
+    unsigned       noutbox;
+    unsigned       outbox_size;
+    int            buffering;
+    lk_BatchSignal *batch;   /* LK_BATCH_MAX signals and their nodes */
+    lk_Coroutine  *running;  /* coroutine this thread switched to */
+    lk_Coroutine  *spare;    /* finished one, for the next handler */
+#ifdef LK_COROUTINE_FIBER
+    void          *fiber;    /* the thread, converted on first use */
+#endif
+} lk_Cache;
+
+typedef struct lk_ServiceQueue { /* lkQ_type(), named for C++ linkage */
+    lk_Service    *first;
+    lk_Service   **plast;
+} lk_ServiceQueue;
+
+typedef struct lk_RunQueue {
+    lk_ServiceQueue q[LK_PRIORITIES];
+    long           count; /* services in q, peeked without the lock */
+} lk_RunQueue;
+
+typedef struct lk_Worker {
+    lk_State      *S;
+    int            index;
+    lk_Lock        lock;
+    lk_RunQueue    queue;    /* services activated by this worker */
+    lk_Service    *runnext;  /* last woken service, runs after this batch */
+    unsigned       nrunnext; /* consecutive runnext dispatches */
+    unsigned long  spin_ns;  /* adapts between spin/floor and spin */
+    unsigned long  nwaits[LK_PRIORITIES]; /* queue wait, by this worker */
+    lk_Nanotime    waittime[LK_PRIORITIES];
+    lk_Nanotime    maxwait[LK_PRIORITIES];
+} lk_Worker;
+
 struct lk_State {
     lk_Service     root;
-    int            nservices;
-    int            nthreads;
+    long           nservices; /* changed under lock, atomic */
+    long           nthreads; /* -1 before lk_start, atomic */
     lk_Table       slot_names;
     lk_Slot       *logger;
     lk_Lock        lock;
 
-    lkQ_type(lk_Service) main_queue;
+    lk_RunQueue    main_queue; /* services activated outside workers */
     lk_Event       queue_event;
     lk_Lock        queue_lock;
+    long           nidle;    /* parked workers, changed under queue_lock */
+    long           nspinning;
+    unsigned long  spin_ns;  /* longest spin before parking, 0: none */
+    int            steal;
+    int            runnext;
+    unsigned long  aging_ns;
+    long           npriority[LK_PRIORITIES]; /* services in each class */
+    int            waitstats;
+    int            outbox;
+    int            nworkers;
+    lk_TlsKey      worker_index;
+    lk_Worker      workers[LK_MAX_THREADS];
 
     lk_MemPool     services;
     lk_MemPool     slots;
@@ -512,8 +923,32 @@ struct lk_State {
     lk_MemPool     defers;
     lk_MemPool     signals;
     lk_MemPool     sources;
-    lk_MemPool     smallpieces;
+    lk_MemPool     calls;
+    lk_MemPool     smallpieces[LK_SIZECLASSES];
     lk_Lock        pool_lock;
+    lk_TlsKey      cache_index;
+    long           lasttrim;
+    int            trim_interval; /* ms, 0 disables background trimming */
+    int            trim_high;     /* trim when free > live*high% ... */
+    int            trim_low;      /* ... down to free = live*low% */
+
+    lk_Timer     **timers;       /* binary heap on deadline */
+    unsigned       ntimers;
+    unsigned       timers_size;
+    long           nextdeadline; /* of timers[0], 0: no timer */
+    lk_Lock        timer_lock;
+    lk_Coroutine  *coroutines;   /* free ones, under pool_lock */
+    unsigned       ncoroutines;
+    size_t         stacksize;
+    long           nunguarded;   /* stacks mprotect failed on */
+
+    lk_Lock        poller_lock;  /* the shared workers of event polls */
+    lk_Event       poller_event;
+    lk_Poll       *ready_first;
+    lk_Poll       *ready_last;
+    int            npollers;
+    int            poller_stop;
+    lk_Thread      pollers[LK_MAX_POLLERS];
 
     lk_Table       config;
     lk_Lock        config_lock;
@@ -536,9 +971,9 @@ struct lk_State {
 #endif
 
 struct lk_Data {
-    unsigned size     : 24;
-    unsigned len      : 24;
-    unsigned refcount : 16;
+    long     refcount;
+    unsigned size;
+    unsigned len;
 };
 
 LK_API size_t lk_len  (lk_Data *data) { return data-- ? data->len  : 0; }
@@ -582,46 +1017,387 @@ LK_API char *lk_strcpy (char *buff, const char *s, size_t len) {
     return buff;
 }
 
-LK_API void *lk_malloc (lk_State *S, size_t size) {
-    void *newptr;
-    if (size > LK_SMALLPIECE_LEN)
-        newptr = S->allocf(S->alloc_ud, NULL, size, 0);
-    else {
-        lk_lock(S->pool_lock);
-        newptr = lk_poolalloc(S, &S->smallpieces);
-        lk_unlock(S->pool_lock);
+#define lkM_alloc(S,pool)     lkM_palloc((S), &(S)->pool, \
+                                    offsetof(lk_Cache, pool))
+#define lkM_free(S,pool,obj)  lkM_pfree((S), &(S)->pool, \
+                                    offsetof(lk_Cache, pool), (obj))
+
+static lk_Magazine *lkM_magazine (lk_State *S, size_t offset) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    return cache ? (lk_Magazine*)((char*)cache + offset) : NULL;
+}
+
+static void *lkM_palloc (lk_State *S, lk_MemPool *mpool, size_t offset) {
+    lk_Magazine *m = lkM_magazine(S, offset);
+    void *obj;
+    if (m != NULL && m->count != 0)
+        return m->objs[--m->count];
+    lk_lock(S->pool_lock);
+    obj = lk_poolalloc(S, mpool);
+    while (m != NULL && m->count < m->limit/2)
+        m->objs[m->count++] = lk_poolalloc(S, mpool);
+    lk_unlock(S->pool_lock);
+    return obj;
+}
+
+static void lkM_pfree (lk_State *S, lk_MemPool *mpool, size_t offset, void *obj) {
+    lk_Magazine *m = lkM_magazine(S, offset);
+    unsigned i, half = m ? m->limit/2 : 0;
+    if (m != NULL && m->count < m->limit) {
+        m->objs[m->count++] = obj;
+        return;
     }
-    if (newptr == NULL) return lkM_outofmemory();
-    return newptr;
+    /* magazine full: hand the coldest half back to the pool */
+    lk_lock(S->pool_lock);
+    lk_poolfree(mpool, obj);
+    for (i = 0; i < half; ++i)
+        lk_poolfree(mpool, m->objs[i]);
+    lk_unlock(S->pool_lock);
+    if (m != NULL) {
+        m->count -= half;
+        memmove(m->objs, m->objs + half, m->count * sizeof(void*));
+    }
+}
+
+static const unsigned short lkM_classsize[LK_SIZECLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096
+};
+
+static int lkM_sizeclass (size_t size) {
+    static const unsigned char class16[] = { /* (size+15)/16 -> class */
+        0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+    };
+    int i = 8;
+    assert(size <= LK_SMALLPIECE_LEN);
+    if (size <= 256) return class16[(size + 15) >> 4];
+    while (lkM_classsize[i] < size) ++i;
+    return i;
+}
+
+static void *lkM_smallalloc (lk_State *S, int cls) {
+    return lkM_palloc(S, &S->smallpieces[cls],
+            offsetof(lk_Cache, smallpieces) + cls*sizeof(lk_Magazine));
+}
+
+static void lkM_smallfree (lk_State *S, int cls, void *ptr) {
+    lkM_pfree(S, &S->smallpieces[cls],
+            offsetof(lk_Cache, smallpieces) + cls*sizeof(lk_Magazine), ptr);
+}
+
+static void lkM_flushmagazine (lk_MemPool *mpool, lk_Magazine *m) {
+    while (m->count != 0)
+        lk_poolfree(mpool, m->objs[--m->count]);
+}
+
+static void lkM_opencache (lk_State *S, lk_Cache *cache) {
+    int i;
+    memset(cache, 0, sizeof(*cache));
+    cache->defers.limit  = LK_MAGAZINE_SIZE;
+    cache->signals.limit = LK_MAGAZINE_SIZE;
+    cache->sources.limit = LK_MAGAZINE_SIZE;
+    cache->calls.limit   = LK_MAGAZINE_SIZE;
+    for (i = 0; i < LK_SIZECLASSES; ++i) {
+        unsigned limit = LK_MAGAZINE_BYTES / lkM_classsize[i];
+        cache->smallpieces[i].limit = limit < LK_MAGAZINE_SIZE ?
+            limit : LK_MAGAZINE_SIZE;
+    }
+    lk_settls(S->cache_index, cache);
+}
+
+static void lkM_flushcache (lk_State *S, lk_Cache *cache) {
+    int i;
+    lkM_flushmagazine(&S->defers, &cache->defers);
+    lkM_flushmagazine(&S->signals, &cache->signals);
+    lkM_flushmagazine(&S->sources, &cache->sources);
+    lkM_flushmagazine(&S->calls, &cache->calls);
+    for (i = 0; i < LK_SIZECLASSES; ++i)
+        lkM_flushmagazine(&S->smallpieces[i], &cache->smallpieces[i]);
+}
+
+static void lkM_resetarena (lk_State *S, lk_Arena *arena, int keep) {
+    lk_ArenaChunk *chunk = arena->chunks, *kept = NULL;
+    arena->chunks = NULL;
+    arena->cur = arena->end = NULL;
+    while (chunk != NULL) { /* keep one normal chunk for the next batch */
+        lk_ArenaChunk *next = chunk->next;
+        if (keep && kept == NULL && chunk->size == LK_ARENA_CHUNK)
+            kept = chunk;
+        else
+            S->allocf(S->alloc_ud, chunk, 0, chunk->size);
+        chunk = next;
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+        arena->chunks = kept;
+        arena->cur = (char*)(kept + 1);
+        arena->end = (char*)kept + kept->size;
+    }
+}
+
+static void lkM_closecache (lk_State *S, lk_Cache *cache) {
+    lk_settls(S->cache_index, NULL);
+    assert(cache->noutbox == 0);
+    if (cache->outbox != NULL)
+        S->allocf(S->alloc_ud, cache->outbox, 0,
+                cache->outbox_size * sizeof(lk_SignalNode*));
+    if (cache->batch != NULL)
+        S->allocf(S->alloc_ud, cache->batch, 0, LK_BATCH_BYTES);
+    lkM_resetarena(S, &cache->arena, 0);
+    lk_lock(S->pool_lock);
+    lkM_flushcache(S, cache);
+    lk_unlock(S->pool_lock);
 }
 
+static void lkM_endbatch (lk_State *S) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    if (cache != NULL && cache->arena.chunks != NULL)
+        lkM_resetarena(S, &cache->arena, 1);
+}
+
+static void *lkM_arenaalloc (lk_State *S, lk_Arena *arena, size_t size) {
+    const size_t align = sizeof(lk_ArenaChunk);
+    char *ptr;
+    size = (size + align - 1) & ~(align - 1);
+    if (size > (size_t)(arena->end - arena->cur)) {
+        size_t csize = LK_ARENA_CHUNK;
+        lk_ArenaChunk *chunk;
+        if (size > LK_ARENA_CHUNK/4) csize = size + sizeof(lk_ArenaChunk);
+        chunk = (lk_ArenaChunk*)S->allocf(S->alloc_ud, NULL, csize, 0);
+        if (chunk == NULL) return NULL;
+        chunk->size = csize;
+        if (csize != LK_ARENA_CHUNK && arena->chunks != NULL) {
+            /* big block on its own: keep bumping in the current chunk */
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+            return chunk + 1;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->cur = (char*)(chunk + 1);
+        arena->end = (char*)chunk + csize;
+    }
+    ptr = arena->cur;
+    arena->cur += size;
+    return ptr;
+}
+
+/* scratch of the library itself, never kept across a coroutine switch */
+static void *lkM_tmpalloc (lk_State *S, size_t size) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    return cache != NULL ? lkM_arenaalloc(S, &cache->arena, size) : NULL;
+}
+
+/* a coroutine may lk_wait while the worker runs other dispatches, so it
+ * allocates from its own arena */
+LK_API void *lk_tmpalloc (lk_State *S, size_t size) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    if (cache == NULL) return NULL; /* not in a worker or poll thread */
+    return lkM_arenaalloc(S, cache->running != NULL ?
+            &cache->running->arena : &cache->arena, size);
+}
+
+static void lkM_freeorphan (lk_Service *svr) {
+    lk_State *S = svr->slot.S;
+    if (!lk_atomiccas(&svr->orphan, 1, 2)) return; /* not deleted, or gone */
+    lk_lock(S->pool_lock);
+    lk_poolfree(&S->services, svr);
+    lk_unlock(S->pool_lock);
+}
+
+static void lkM_charge (lk_Service *svr, long delta) {
+    long used, peak, quota;
+    if (svr == NULL || delta == 0) return;
+    used = lk_atomicadd(&svr->memused, delta);
+    assert(used >= 0);
+    if (delta < 0) {
+        if (used == 0) lkM_freeorphan(svr);
+        return;
+    }
+    while (used > (peak = lk_atomicload(&svr->mempeak))
+            && !lk_atomiccas(&svr->mempeak, peak, used))
+        ;
+    /* tell the owner once each time the quota is crossed */
+    quota = svr->memquota;
+    if (quota > 0 && used > quota && used - delta <= quota
+            && svr->quotaf != NULL)
+        svr->quotaf(svr->slot.S, svr->quota_ud, svr, (size_t)used);
+}
+
+/* every lk_malloc() block starts with the service charged for it, so
+ * that freeing it credits that one, not the service freeing it. The
+ * head counts in the size class: sizes below are what callers ask for */
+typedef union lk_BlockHead {
+    lk_Service *owner;
+    void       *align[2];
+} lk_BlockHead;
+
+#define lkM_blocksize(size)  ((size) + sizeof(lk_BlockHead))
+#define lkM_issmall(size)    (lkM_blocksize(size) <= LK_SMALLPIECE_LEN)
+#define lkM_blockclass(size) lkM_sizeclass(lkM_blocksize(size))
+
+static size_t lkM_chargesize (size_t size) {
+    return lkM_issmall(size) ? lkM_classsize[lkM_blockclass(size)]
+        : lkM_blocksize(size);
+}
+
+#define lkM_owner(ptr) (((lk_BlockHead*)(ptr) - 1)->owner)
+
+static void *lkM_malloc (lk_State *S, lk_Service *owner, size_t size) {
+    lk_BlockHead *head;
+    if (!lkM_issmall(size))
+        head = (lk_BlockHead*)S->allocf(S->alloc_ud, NULL,
+                lkM_blocksize(size), 0);
+    else
+        head = (lk_BlockHead*)lkM_smallalloc(S, lkM_blockclass(size));
+    if (head == NULL) return lkM_outofmemory();
+    head->owner = owner;
+    lkM_charge(owner, (long)lkM_chargesize(size));
+    return head + 1;
+}
+
+LK_API void *lk_malloc (lk_State *S, size_t size)
+{ return lkM_malloc(S, lk_self(S), size); }
+
 LK_API void *lk_realloc (lk_State *S, void *ptr, size_t size, size_t osize) {
+    lk_BlockHead *head, *newhead;
     void *newptr;
-    if (osize <= LK_SMALLPIECE_LEN && size <= LK_SMALLPIECE_LEN)
+    if (ptr == NULL)
+        return lk_malloc(S, size);
+    head = (lk_BlockHead*)ptr - 1;
+    if (lkM_issmall(osize) && lkM_issmall(size)
+            && lkM_blockclass(osize) == lkM_blockclass(size))
         return ptr;
-    else if (osize > LK_SMALLPIECE_LEN) {
-        newptr = S->allocf(S->alloc_ud, ptr, size, osize);
-        if (newptr == NULL) return lkM_outofmemory();
-    }
-    else {
-        newptr = lk_malloc(S, size);
-        memcpy(newptr, ptr, osize);
-        lk_free(S, ptr, osize);
+    else if (!lkM_issmall(osize) && !lkM_issmall(size)) {
+        lk_Service *owner = head->owner;
+        newhead = (lk_BlockHead*)S->allocf(S->alloc_ud, head,
+                lkM_blocksize(size), lkM_blocksize(osize));
+        if (newhead == NULL) return lkM_outofmemory();
+        /* the block moves to the service growing it */
+        newhead->owner = lk_self(S);
+        lkM_charge(newhead->owner, (long)lkM_chargesize(size));
+        lkM_charge(owner, -(long)lkM_chargesize(osize));
+        return newhead + 1;
     }
+    newptr = lk_malloc(S, size);
+    memcpy(newptr, ptr, osize < size ? osize : size);
+    lk_free(S, ptr, osize);
     return newptr;
 }
 
 LK_API void lk_free (lk_State *S, void *ptr, size_t osize) {
+    lk_BlockHead *head;
+    lk_Service *owner;
     void *newptr = NULL;
     if (ptr == NULL) return;
-    if (osize > LK_SMALLPIECE_LEN)
-        newptr = S->allocf(S->alloc_ud, ptr, 0, osize);
-    else {
-        lk_lock(S->pool_lock);
-        lk_poolfree(&S->smallpieces, ptr);
-        lk_unlock(S->pool_lock);
-    }
+    head = (lk_BlockHead*)ptr - 1;
+    owner = head->owner;
+    if (!lkM_issmall(osize))
+        newptr = S->allocf(S->alloc_ud, head, 0, lkM_blocksize(osize));
+    else
+        lkM_smallfree(S, lkM_blockclass(osize), head);
     assert(newptr == NULL);
+    /* last: this may free a deleted owner */
+    lkM_charge(owner, -(long)lkM_chargesize(osize));
+}
+
+/* every pool page starts with this header, objects follow it */
+typedef struct lk_PoolPage {
+    struct lk_PoolPage *next;
+    size_t size; /* low bit set if the page is mapped from the OS */
+} lk_PoolPage;
+
+#define LK_PAGE_MAPPED        1
+#define LK_POOL_SHARED        0x80 /* state pool, pages are not charged */
+#define lkM_pagesize(page)    ((page)->size & ~(size_t)LK_PAGE_MAPPED)
+#define lkM_pagecap(mp, page) \
+    ((lkM_pagesize(page) - sizeof(lk_PoolPage)) / (mp)->size)
+
+#ifdef _WIN32
+
+static void *lkM_mappage (size_t size) {
+    SIZE_T large = GetLargePageMinimum();
+    void *page = NULL;
+    if (large != 0 && size % large == 0)
+        page = VirtualAlloc(NULL, size,
+                MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (page == NULL) /* no SeLockMemoryPrivilege: use normal pages */
+        page = VirtualAlloc(NULL, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    return page;
+}
+
+static void lkM_unmappage (void *page, size_t size)
+{ (void)size; VirtualFree(page, 0, MEM_RELEASE); }
+
+#elif defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static void *lkM_mappage (size_t size) {
+    const int prot = PROT_READ|PROT_WRITE, flags = MAP_PRIVATE|MAP_ANONYMOUS;
+    char *page, *aligned;
+    size_t head;
+#ifdef MAP_HUGETLB
+    if (size % LK_HUGEPAGESIZE == 0) {
+        page = (char*)mmap(NULL, size, prot, flags|MAP_HUGETLB, -1, 0);
+        if (page != (char*)MAP_FAILED) return page;
+    }
+#endif
+    /* no reserved huge pages: align the mapping so that THP can back it */
+    page = (char*)mmap(NULL, size + LK_HUGEPAGESIZE, prot, flags, -1, 0);
+    if (page == (char*)MAP_FAILED) return NULL;
+    head = (LK_HUGEPAGESIZE - (size_t)page % LK_HUGEPAGESIZE) % LK_HUGEPAGESIZE;
+    aligned = page + head;
+    if (head != 0) munmap(page, head);
+    munmap(aligned + size, LK_HUGEPAGESIZE - head);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+static void lkM_unmappage (void *page, size_t size)
+{ munmap(page, size); }
+
+#else /* no anonymous mappings, always fall back to allocf */
+
+static void *lkM_mappage (size_t size) { (void)size; return NULL; }
+static void lkM_unmappage (void *page, size_t size) { (void)page, (void)size; }
+
+#endif
+
+static lk_PoolPage *lkM_newpage (lk_State *S, lk_MemPool *mpool) {
+    size_t size = mpool->pagesize;
+    lk_PoolPage *page = NULL;
+    /* pages never come from lk_malloc(): callers may hold pool_lock */
+    if ((mpool->flags & LK_POOL_HUGEPAGE) != 0
+            && (page = (lk_PoolPage*)lkM_mappage(size)) != NULL)
+        size |= LK_PAGE_MAPPED;
+    else if ((page = (lk_PoolPage*)S->allocf(S->alloc_ud,
+                    NULL, size, 0)) == NULL)
+        return (lk_PoolPage*)lkM_outofmemory();
+    page->size = size;
+    if ((mpool->flags & LK_POOL_SHARED) == 0)
+        lkM_charge(mpool->owner, (long)lkM_pagesize(page));
+    return page;
+}
+
+static void lkM_freepage (lk_State *S, lk_MemPool *mpool, lk_PoolPage *page) {
+    if ((mpool->flags & LK_POOL_SHARED) == 0)
+        lkM_charge(mpool->owner, -(long)lkM_pagesize(page));
+    if ((page->size & LK_PAGE_MAPPED) != 0)
+        lkM_unmappage(page, lkM_pagesize(page));
+    else
+        S->allocf(S->alloc_ud, page, 0, page->size);
+}
+
+static size_t lkM_defpagesize (size_t size) {
+    size_t pagesize = LK_MPOOLPAGESIZE;
+    /* big objects get bigger pages, so a page holds at least 8 of them */
+    while ((pagesize - sizeof(lk_PoolPage)) / size < 8)
+        pagesize <<= 1;
+    return pagesize;
 }
 
 LK_API void lk_initpool (lk_MemPool *mpool, size_t size) {
@@ -629,49 +1405,205 @@ LK_API void lk_initpool (lk_MemPool *mpool, size_t size) {
     assert(((sp - 1) & sp) == 0);
     mpool->pages = NULL;
     mpool->freed = NULL;
+    mpool->npages = 0;
+    mpool->nobjs  = 0;
+    mpool->nfree  = 0;
+    mpool->reserve = 0;
+    mpool->flags  = 0;
+    mpool->owner  = NULL;
     if (size < sp)      size = sp;
     if (size % sp != 0) size = (size + sp - 1) & ~(sp - 1);
     mpool->size = size;
+    mpool->pagesize = lkM_defpagesize(size);
     LK_DEBUG_POOL(mpool->allocated = 0);
-    assert(LK_MPOOLPAGESIZE / size > 2);
+}
+
+LK_API int lk_setpoolpage (lk_MemPool *mpool, size_t pagesize, unsigned flags) {
+    const size_t sp = sizeof(void*);
+    if (pagesize % sp != 0) pagesize = (pagesize + sp - 1) & ~(sp - 1);
+    if (pagesize < sizeof(lk_PoolPage) + mpool->size*2)
+        return LK_ERR;
+    /* pages already allocated keep their size */
+    mpool->pagesize = pagesize;
+    mpool->flags    = (mpool->flags & LK_POOL_SHARED) | flags;
+    return LK_OK;
 }
 
 LK_API void lk_freepool (lk_State *S, lk_MemPool *mpool) {
-    const size_t offset = LK_MPOOLPAGESIZE - sizeof(void*);
+    size_t pagesize = mpool->pagesize;
+    unsigned flags = mpool->flags;
     LK_DEBUG_POOL(assert(mpool->allocated == 0));
     while (mpool->pages != NULL) {
-        void *next = *(void**)((char*)mpool->pages + offset);
-        lk_free(S, mpool->pages, LK_MPOOLPAGESIZE);
+        lk_PoolPage *next = ((lk_PoolPage*)mpool->pages)->next;
+        lkM_freepage(S, mpool, (lk_PoolPage*)mpool->pages);
         mpool->pages = next;
     }
     lk_initpool(mpool, mpool->size);
+    mpool->pagesize = pagesize;
+    mpool->flags    = flags;
+}
+
+static void lkM_addpage (lk_State *S, lk_MemPool *mpool) {
+    lk_PoolPage *newpage;
+    size_t count;
+    char *first, *end;
+    /* an empty pool holds no charge: whoever refills it owns it */
+    if (mpool->npages == 0) mpool->owner = lk_self(S);
+    newpage = lkM_newpage(S, mpool);
+    count = lkM_pagecap(mpool, newpage);
+    first = (char*)(newpage + 1);
+    newpage->next = (lk_PoolPage*)mpool->pages;
+    mpool->pages = newpage;
+    ++mpool->npages;
+    mpool->nobjs += count;
+    mpool->nfree += count;
+    end = first + count*mpool->size;
+    while (end != first) {
+        end -= mpool->size;
+        *(void**)end = mpool->freed;
+        mpool->freed = end;
+    }
 }
 
 LK_API void *lk_poolalloc (lk_State *S, lk_MemPool *mpool) {
-    void *obj = mpool->freed;
+    void *obj;
     LK_DEBUG_POOL(++mpool->allocated);
-    if (obj == NULL) {
-        const size_t offset = LK_MPOOLPAGESIZE - sizeof(void*);
-        void *end, *newpage = lk_malloc(S, LK_MPOOLPAGESIZE);
-        *(void**)((char*)newpage + offset) = mpool->pages;
-        mpool->pages = newpage;
-        end = (char*)newpage + (offset/mpool->size-1)*mpool->size;
-        while (end != newpage) {
-            *(void**)end = mpool->freed;
-            mpool->freed = end;
-            end = (char*)end - mpool->size;
-        }
-        return end;
-    }
+    if (mpool->freed == NULL) lkM_addpage(S, mpool);
+    obj = mpool->freed;
     mpool->freed = *(void**)obj;
+    --mpool->nfree;
     return obj;
 }
 
+LK_API void lk_poolreserve (lk_State *S, lk_MemPool *mpool, size_t count) {
+    mpool->reserve = count;
+    while (mpool->nfree < count)
+        lkM_addpage(S, mpool);
+}
+
 LK_API void lk_poolfree (lk_MemPool *mpool, void *obj) {
     LK_DEBUG_POOL(--mpool->allocated);
     LK_DEBUG_POOL(assert((signed)mpool->allocated >= 0));
     *(void**)obj = mpool->freed;
     mpool->freed = obj;
+    ++mpool->nfree;
+}
+
+static int lkM_comppage (const void *lhs, const void *rhs) {
+    const char *l = *(const char**)lhs, *r = *(const char**)rhs;
+    return l < r ? -1 : l > r;
+}
+
+static size_t lkM_findpage (lk_PoolPage **pages, size_t npages, void *obj) {
+    size_t lo = 0, hi = npages;
+    while (hi - lo > 1) { /* last page starting at or below obj */
+        size_t mid = (lo + hi) / 2;
+        if ((char*)pages[mid] <= (char*)obj) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* the pages and free list of a pool, taken out while being trimmed */
+typedef struct lk_PoolTrim {
+    lk_PoolPage *pages, *lastpage;
+    void   *freed, *lastfreed;
+    size_t  npages, nobjs, nfree;
+} lk_PoolTrim;
+
+static void lkM_detachpool (lk_MemPool *mpool, lk_PoolTrim *trim) {
+    trim->pages  = (lk_PoolPage*)mpool->pages;
+    trim->freed  = mpool->freed;
+    trim->npages = mpool->npages;
+    trim->nobjs  = mpool->nobjs;
+    trim->nfree  = mpool->nfree;
+    trim->lastpage  = NULL;
+    trim->lastfreed = NULL;
+    mpool->pages = mpool->freed = NULL;
+    mpool->npages = mpool->nobjs = mpool->nfree = 0;
+}
+
+static void lkM_splicepool (lk_MemPool *mpool, lk_PoolTrim *trim) {
+    /* pages added to the pool meanwhile stay in front */
+    if (trim->lastpage != NULL) {
+        trim->lastpage->next = (lk_PoolPage*)mpool->pages;
+        mpool->pages = trim->pages;
+    }
+    if (trim->lastfreed != NULL) {
+        *(void**)trim->lastfreed = mpool->freed;
+        mpool->freed = trim->freed;
+    }
+    mpool->npages += trim->npages;
+    mpool->nobjs  += trim->nobjs;
+    mpool->nfree  += trim->nfree;
+}
+
+static size_t lkM_trimpages (lk_State *S, lk_MemPool *mpool,
+        lk_PoolTrim *trim, size_t keep) {
+    size_t i, npages = trim->npages, total = 0;
+    size_t scratch = npages * (sizeof(lk_PoolPage*) + sizeof(size_t));
+    lk_PoolPage **pages = NULL, *page;
+    size_t *counts = NULL;
+    void *obj, *next;
+    /* not lk_malloc(): the caller may hold the lock of our pools */
+    if (npages != 0 && trim->nfree > keep)
+        pages = (lk_PoolPage**)S->allocf(S->alloc_ud, NULL, scratch, 0);
+    if (pages != NULL) {
+        counts = (size_t*)(pages + npages);
+        for (i = 0, page = trim->pages; i < npages; ++i) {
+            pages[i] = page, counts[i] = 0;
+            page = page->next;
+        }
+        qsort(pages, npages, sizeof(lk_PoolPage*), lkM_comppage);
+        for (obj = trim->freed; obj != NULL; obj = *(void**)obj)
+            ++counts[lkM_findpage(pages, npages, obj)];
+        /* release empty pages, but keep at least `keep` free objects */
+        for (i = 0; i < npages; ++i) {
+            size_t cap = lkM_pagecap(mpool, pages[i]);
+            if (counts[i] != cap || trim->nfree - cap < keep) continue;
+            counts[i] = LK_MAX_SIZET;
+            trim->nfree -= cap;
+            trim->nobjs -= cap;
+        }
+    }
+    /* rebuild both lists, remembering their tails for the splice */
+    obj = trim->freed, trim->freed = NULL;
+    for (; obj != NULL; obj = next) {
+        next = *(void**)obj;
+        if (counts != NULL
+                && counts[lkM_findpage(pages, npages, obj)] == LK_MAX_SIZET)
+            continue;
+        if (trim->lastfreed == NULL) trim->freed = obj;
+        else *(void**)trim->lastfreed = obj;
+        trim->lastfreed = obj;
+    }
+    page = trim->pages, trim->pages = NULL;
+    for (; page != NULL; page = (lk_PoolPage*)next) {
+        next = page->next;
+        if (counts != NULL
+                && counts[lkM_findpage(pages, npages, page)] == LK_MAX_SIZET) {
+            total += lkM_pagesize(page);
+            --trim->npages;
+            lkM_freepage(S, mpool, page);
+            continue;
+        }
+        if (trim->lastpage == NULL) trim->pages = page;
+        else trim->lastpage->next = page;
+        trim->lastpage = page;
+    }
+    if (pages != NULL) S->allocf(S->alloc_ud, pages, 0, scratch);
+    return total;
+}
+
+LK_API size_t lk_trimpool (lk_State *S, lk_MemPool *mpool, size_t keep) {
+    lk_PoolTrim trim;
+    size_t total;
+    if (keep < mpool->reserve) keep = mpool->reserve;
+    if (mpool->npages == 0 || mpool->nfree <= keep) return 0;
+    lkM_detachpool(mpool, &trim);
+    total = lkM_trimpages(S, mpool, &trim, keep);
+    lkM_splicepool(mpool, &trim);
+    return total;
 }
 
 LK_API lk_Data *lk_newdata (lk_State *S, size_t size) {
@@ -681,28 +1613,26 @@ LK_API lk_Data *lk_newdata (lk_State *S, size_t size) {
     data->size     = (unsigned)size;
     data->len      = 0;
     data->refcount = 0;
-    if (rawlen <= LK_SMALLPIECE_LEN)
-        data->size = LK_SMALLPIECE_LEN - sizeof(lk_Data);
+    if (lkM_issmall(rawlen)) /* use the whole size class */
+        data->size = (unsigned)(lkM_chargesize(rawlen)
+                - sizeof(lk_BlockHead) - sizeof(lk_Data));
     return data + 1;
 }
 
 LK_API size_t lk_usedata (lk_State *S, lk_Data *data) {
-    size_t refcount;
+    (void)S;
     if (data-- == NULL) return 0;
-    lk_lock(S->lock);
-    refcount = ++data->refcount;
-    lk_unlock(S->lock);
-    return refcount;
+    return (size_t)lk_atomicinc(&data->refcount);
 }
 
 LK_API size_t lk_deldata (lk_State *S, lk_Data *data) {
-    size_t refcount = 0;
+    long refcount;
     if (data-- == NULL) return 0;
-    lk_lock(S->lock);
-    if (data->refcount > 1) refcount = --data->refcount;
-    lk_unlock(S->lock);
-    if (refcount == 0) lk_free(S, data, data->size + sizeof(lk_Data));
-    return refcount;
+    /* both 0 (fresh) and 1 (used once) mean a single owner */
+    if ((refcount = lk_atomicdec(&data->refcount)) > 0)
+        return (size_t)refcount;
+    lk_free(S, data, data->size + sizeof(lk_Data));
+    return 0;
 }
 
 LK_API lk_Data *lk_newlstring (lk_State *S, const char *s, size_t len) {
@@ -797,7 +1727,9 @@ LK_API size_t lk_resizetable (lk_State *S, lk_Table *t, size_t len) {
     nt.size = lkH_hashsize(t, len);
     if (nt.size == 0) return 0;
     nt.lastfree = nt.size*nt.entry_size;
-    nt.hash = (lk_Entry*)lk_malloc(S, nt.lastfree);
+    /* a table stays charged to the service that made it */
+    nt.hash = (lk_Entry*)lkM_malloc(S,
+            t->hash ? lkM_owner(t->hash) : lk_self(S), nt.lastfree);
     memset(nt.hash, 0, nt.lastfree);
     for (i = 0; i < size; i += t->entry_size) {
         lk_Entry *olde = lk_index(t->hash, i);
@@ -900,15 +1832,9 @@ static void lkC_calldefers (lk_State *S, lk_Context *ctx) {
         while (defers != NULL) {
             lk_Defer *next = defers->next;
             defers->h(S, defers->ud);
+            lkM_free(S, defers, defers);
             defers = next;
         }
-        lk_lock(S->pool_lock);
-        while (defers != NULL) {
-            lk_Defer *next = defers->next;
-            lk_poolfree(&S->defers, defers);
-            defers = next;
-        }
-        lk_unlock(S->pool_lock);
         ctx->defers = NULL;
     }
 }
@@ -946,9 +1872,7 @@ LK_API int lk_defer (lk_State *S, lk_DeferHandler *h, void *ud) {
     lk_Defer *defer;
     if (ctx == NULL)
         return LK_ERR;
-    lk_lock(S->pool_lock);
-    defer = (lk_Defer*)lk_poolalloc(S, &S->defers);
-    lk_unlock(S->pool_lock);
+    defer = (lk_Defer*)lkM_alloc(S, defers);
     defer->h = h;
     defer->ud = ud;
     defer->next = ctx->defers;
@@ -990,6 +1914,17 @@ LK_API int lk_waitevent (lk_Event *evt, lk_Lock *lock, int waitms) {
     return ret != WAIT_FAILED ? LK_OK : LK_ERR;
 }
 
+static unsigned lkT_clock (void) { return (unsigned)GetTickCount(); }
+
+static lk_Nanotime lkT_nanoclock (void) {
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (lk_Nanotime)(now.QuadPart / freq.QuadPart * 1000000000
+            + now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+}
+
 #else
 
 #include <errno.h>
@@ -1016,72 +1951,580 @@ LK_API int lk_waitevent (lk_Event *evt, lk_Lock *lock, int waitms) {
     else {
         struct timeval tv;
         struct timespec ts;
-        int sec  = waitms / 1000;
-        int usec = waitms % 1000 * 1000;
+        long usec;
         gettimeofday(&tv, NULL);
-        if (tv.tv_usec + usec > 1000000) {
-            sec += 1;
-            usec = (tv.tv_usec + usec) - 1000000;
-        }
-        ts.tv_sec = tv.tv_sec + sec;
-        ts.tv_nsec = (tv.tv_usec + usec) * 1000;
+        usec = (long)tv.tv_usec + waitms % 1000 * 1000L;
+        ts.tv_sec  = tv.tv_sec + waitms / 1000 + usec / 1000000;
+        ts.tv_nsec = usec % 1000000 * 1000; /* past a second is EINVAL */
         ret = pthread_cond_timedwait(evt, lock, &ts);
     }
     return ret == 0 || ret == ETIMEDOUT ? LK_OK : LK_ERR;
 }
 
-#endif
+/* deadlines and budgets must not follow changes of the wall clock */
+#ifdef CLOCK_MONOTONIC
 
+static unsigned lkT_clock (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned)ts.tv_sec*1000 + (unsigned)(ts.tv_nsec/1000000);
+}
 
-/* slot/poll routines */
+static lk_Nanotime lkT_nanoclock (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lk_Nanotime)ts.tv_sec*1000000000 + (lk_Nanotime)ts.tv_nsec;
+}
 
-#define lkP_ispoll(obj)   ((((lk_Slot*)(obj))->flags & 0x01) != 0)
-#define lkP_issvr(obj)    ((((lk_Slot*)(obj))->flags & 0x02) != 0)
-#define lkP_isweak(obj)   ((((lk_Slot*)(obj))->flags & 0x04) != 0)
-#define lkP_isdead(obj)   ((((lk_Slot*)(obj))->flags & 0x08) != 0)
-#define lkP_isactive(obj) ((((lk_Slot*)(obj))->flags & 0x10) != 0)
+#else /* no monotonic clock: the time of day is all there is */
 
-#define lkP_setpoll(obj)   (((lk_Slot*)(obj))->flags |= 0x01)
-#define lkP_setsvr(obj)    (((lk_Slot*)(obj))->flags |= 0x02)
-#define lkP_setweak(obj)   (((lk_Slot*)(obj))->flags |= 0x04)
-#define lkP_setdead(obj)   (((lk_Slot*)(obj))->flags |= 0x08)
-#define lkP_setactive(obj) (((lk_Slot*)(obj))->flags |= 0x10)
-#define lkP_clractive(obj) (((lk_Slot*)(obj))->flags &= ~0x10)
+static unsigned lkT_clock (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned)tv.tv_sec*1000 + (unsigned)tv.tv_usec/1000;
+}
 
-#define lkP_getter(name, type, field) \
-LK_API type lk_##name (lk_Slot *slot) { return slot ? slot->field : NULL; }
-#define lkP_setter(name, type, field) \
-LK_API void lk_set##name (lk_Slot *s, type v) { if (s) s->field = v; }
-lkP_getter(name,        const char *, name     )
-lkP_getter(service,     lk_Service *, service  )
-lkP_getter(state,       lk_State *,   S        )
-lkP_getter(data,        void *,       userdata )
-lkP_setter(data,        void *,       userdata )
-lkP_getter(slothandler, lk_Handler *, handler  )
-lkP_setter(slothandler, lk_Handler *, handler  )
-lkP_getter(refactor,    lk_Handler *, refactor )
-lkP_setter(refactor,    lk_Handler *, refactor )
-#undef lkP_getter
-#undef lkP_setter
+static lk_Nanotime lkT_nanoclock (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (lk_Nanotime)tv.tv_sec*1000000000 + (lk_Nanotime)tv.tv_usec*1000;
+}
 
-LK_API lk_Slot *lk_current (lk_State *S)
-{ lk_Context *ctx = lk_context(S); return ctx ? ctx->current : &S->root.slot; }
+#endif
 
-static void lkP_name (char *buff, const char *svr, const char *name) {
-    size_t svrlen = strlen(svr);
-    assert(svrlen < LK_MAX_NAMESIZE);
-    memcpy(buff, svr, svrlen); buff += svrlen;
-    if (name != NULL) {
-        size_t namelen = strlen(name);
-        *buff++ = '.';
-        assert(namelen < LK_MAX_NAMESIZE);
-        memcpy(buff, name, namelen); buff += namelen;
+#endif
+
+
+/* timer routines: one heap of deadlines for the state, fired by workers
+ * between dispatches and before they park */
+
+static int lkT_before (unsigned a, unsigned b) { return (int)(a - b) < 0; }
+
+static void lkT_siftup (lk_Timer **heap, unsigned i) {
+    lk_Timer *t = heap[i];
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (!lkT_before(t->deadline, heap[parent]->deadline)) break;
+        heap[i] = heap[parent];
+        heap[i]->index = i + 1;
+        i = parent;
     }
-    *buff = '\0';
+    heap[i] = t, t->index = i + 1;
 }
 
-static lk_Slot *lkP_new (lk_State *S, lk_MemPool *pool, lk_Service *svr, const char *name) {
-    lk_Slot *slot = NULL;
+static void lkT_siftdown (lk_Timer **heap, unsigned n, unsigned i) {
+    lk_Timer *t = heap[i];
+    for (;;) {
+        unsigned child = i * 2 + 1;
+        if (child >= n) break;
+        if (child + 1 < n && lkT_before(heap[child+1]->deadline,
+                    heap[child]->deadline))
+            ++child;
+        if (!lkT_before(heap[child]->deadline, t->deadline)) break;
+        heap[i] = heap[child];
+        heap[i]->index = i + 1;
+        i = child;
+    }
+    heap[i] = t, t->index = i + 1;
+}
+
+static void lkT_updatenext (lk_State *S) {
+    unsigned next = S->ntimers != 0 ? S->timers[0]->deadline : 0;
+    if (S->ntimers != 0 && next == 0) next = 1;
+    /* a barrier before lkT_starttimer reads nidle, see lkG_park */
+    (void)lk_atomicxchg(&S->nextdeadline, (long)next);
+}
+
+static int lkT_starttimer (lk_State *S, lk_Timer *t, unsigned delay) {
+    int first;
+    lk_lock(S->timer_lock);
+    if (S->ntimers == S->timers_size) {
+        unsigned size = S->timers_size ? S->timers_size * 2 : 64;
+        lk_Timer **timers = (lk_Timer**)S->allocf(S->alloc_ud, S->timers,
+                size * sizeof(lk_Timer*), S->timers_size * sizeof(lk_Timer*));
+        if (timers == NULL) {
+            lk_unlock(S->timer_lock);
+            return LK_ERR;
+        }
+        S->timers = timers, S->timers_size = size;
+    }
+    t->deadline = lkT_clock() + delay;
+    S->timers[S->ntimers] = t;
+    lkT_siftup(S->timers, S->ntimers++);
+    if ((first = t->index == 1)) lkT_updatenext(S);
+    lk_unlock(S->timer_lock);
+    /* parked workers and poll workers sleep until the old first deadline */
+    if (first && lk_atomicload(&S->nidle) != 0) {
+        lk_lock(S->queue_lock);
+        lk_signal(S->queue_event);
+        lk_unlock(S->queue_lock);
+    }
+    if (first) {
+        lk_lock(S->poller_lock);
+        if (S->npollers != 0) lk_signal(S->poller_event);
+        lk_unlock(S->poller_lock);
+    }
+    return LK_OK;
+}
+
+static int lkT_stoptimer (lk_State *S, lk_Timer *t) {
+    unsigned i;
+    lk_lock(S->timer_lock);
+    if ((i = t->index) != 0) {
+        lk_Timer *last = S->timers[--S->ntimers];
+        t->index = 0;
+        if (last != t) {
+            S->timers[i - 1] = last;
+            lkT_siftdown(S->timers, S->ntimers, i - 1);
+            lkT_siftup(S->timers, last->index - 1);
+        }
+        lkT_updatenext(S);
+    }
+    lk_unlock(S->timer_lock);
+    return i != 0;
+}
+
+static int lkT_firetimers (lk_State *S) {
+    long next = lk_atomicload(&S->nextdeadline);
+    unsigned now;
+    int count = 0;
+    if (next == 0 || lkT_before(now = lkT_clock(), (unsigned)next))
+        return 0;
+    lk_lock(S->timer_lock);
+    while (S->ntimers != 0 && !lkT_before(now, S->timers[0]->deadline)) {
+        lk_Timer *t = S->timers[0];
+        t->index = 0;
+        if (--S->ntimers != 0) {
+            S->timers[0] = S->timers[S->ntimers];
+            lkT_siftdown(S->timers, S->ntimers, 0);
+        }
+        t->h(S, t); /* under timer_lock: it must not start or stop timers */
+        ++count;
+    }
+    lkT_updatenext(S);
+    lk_unlock(S->timer_lock);
+    return count;
+}
+
+static int lkT_waittime (lk_State *S, int waitms) {
+    long next = lk_atomicload(&S->nextdeadline);
+    int left;
+    if (next == 0) return waitms;
+    left = (int)((unsigned)next - lkT_clock());
+    if (left < 1) left = 1;
+    return waitms < 0 || left < waitms ? left : waitms;
+}
+
+
+/* coroutine routines: a handler of a coroutine service runs on its own
+ * stack, so that lk_wait can switch back to the worker */
+
+#define LKR_IDLE      0 /* cached, or done with its signal */
+#define LKR_RUNNING   1
+#define LKR_SUSPENDED 2
+
+typedef void lkR_Main (lk_Coroutine *co);
+
+static void lkR_run       (lk_Coroutine *co);
+static void lkR_switchout (lk_Coroutine *co);
+
+static void lkR_main (lk_Coroutine *co) {
+    for (;;) { /* a finished coroutine is reused from here */
+        lkR_run(co);
+        co->state = LKR_IDLE;
+        lkR_switchout(co);
+    }
+}
+
+#if defined(LK_COROUTINE_FIBER)
+
+static void WINAPI lkR_fibermain (LPVOID ud)
+{ lkR_main((lk_Coroutine*)ud); }
+
+static lk_Coroutine *lkR_alloc (lk_State *S) {
+    lk_Coroutine *co = (lk_Coroutine*)S->allocf(S->alloc_ud, NULL,
+            sizeof(lk_Coroutine), 0);
+    if (co == NULL) return NULL;
+    memset(co, 0, sizeof(*co));
+    co->S = S;
+    co->fiber = CreateFiberEx(0, S->stacksize, 0, lkR_fibermain, co);
+    if (co->fiber == NULL) {
+        S->allocf(S->alloc_ud, co, 0, sizeof(lk_Coroutine));
+        return NULL;
+    }
+    return co;
+}
+
+static void lkR_dealloc (lk_State *S, lk_Coroutine *co) {
+    lkM_resetarena(S, &co->arena, 0);
+    DeleteFiber(co->fiber);
+    S->allocf(S->alloc_ud, co, 0, sizeof(lk_Coroutine));
+}
+
+static void lkR_switchin (lk_Cache *cache, lk_Coroutine *co) {
+    if (cache->fiber == NULL) cache->fiber = ConvertThreadToFiber(NULL);
+    co->caller = cache->fiber;
+    SwitchToFiber(co->fiber);
+}
+
+static void lkR_switchout (lk_Coroutine *co)
+{ SwitchToFiber(co->caller); }
+
+#elif defined(LK_COROUTINE_UCONTEXT) || defined(LK_COROUTINE_ASM)
+
+static size_t lkR_pagesize (void) { return (size_t)sysconf(_SC_PAGESIZE); }
+
+/* [guard page | stack ... | lk_Coroutine], in one mapping */
+static lk_Coroutine *lkR_newstack (lk_State *S) {
+    size_t page = lkR_pagesize();
+    size_t size = (S->stacksize + page - 1) / page * page + page;
+    size_t head = (sizeof(lk_Coroutine) + 15) & ~(size_t)15;
+    lk_Coroutine *co;
+    char *stack;
+#ifdef MAP_ANONYMOUS
+    stack = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (stack == (char*)MAP_FAILED) return NULL;
+    /* past vm.max_map_count this fails: the stack still works, but an
+     * overflow goes unnoticed, so say it once */
+    if (mprotect(stack, page, PROT_NONE) != 0
+            && lk_atomicinc(&S->nunguarded) == 1)
+        lk_log(S, "W[coroutine]" lk_loc("no guard page for stacks: %s"),
+                strerror(errno));
+#else
+    stack = (char*)S->allocf(S->alloc_ud, NULL, size, 0);
+    if (stack == NULL) return NULL;
+#endif
+    co = (lk_Coroutine*)(stack + size - head);
+    memset(co, 0, sizeof(*co));
+    co->stack = stack;
+    co->size  = size;
+    co->S     = S;
+    return co;
+}
+
+static void lkR_dealloc (lk_State *S, lk_Coroutine *co) {
+    lkM_resetarena(S, &co->arena, 0); /* co lives in the mapping */
+#ifdef MAP_ANONYMOUS
+    munmap(co->stack, co->size);
+#else
+    S->allocf(S->alloc_ud, co->stack, 0, co->size);
+#endif
+}
+
+#endif
+
+#if defined(LK_COROUTINE_UCONTEXT)
+
+static void lkR_ucmain (int hi, int lo) {
+    size_t p = (size_t)(unsigned)hi << 16 << 16 | (size_t)(unsigned)lo;
+    lkR_main((lk_Coroutine*)p);
+}
+
+static lk_Coroutine *lkR_alloc (lk_State *S) {
+    lk_Coroutine *volatile co = lkR_newstack(S); /* across getcontext */
+    size_t p = (size_t)co;
+    if (co == NULL) return NULL;
+    if (getcontext(&co->uc) != 0) {
+        lkR_dealloc(S, co);
+        return NULL;
+    }
+    co->uc.uc_stack.ss_sp   = co->stack + lkR_pagesize();
+    co->uc.uc_stack.ss_size = (size_t)((char*)co - (char*)co->uc.uc_stack.ss_sp);
+    co->uc.uc_link = NULL;
+    makecontext(&co->uc, (void(*)(void))lkR_ucmain, 2,
+            (int)(unsigned)(p >> 16 >> 16), (int)(unsigned)p);
+    return co;
+}
+
+static void lkR_switchin (lk_Cache *cache, lk_Coroutine *co)
+{ (void)cache; swapcontext(&co->caller, &co->uc); }
+
+static void lkR_switchout (lk_Coroutine *co)
+{ swapcontext(&co->uc, &co->caller); }
+
+#elif defined(LK_COROUTINE_ASM)
+
+/* lkR_switch(from, to) pushes the callee-saved registers, stores the stack
+ * pointer to *from, and pops them from the stack at to; a new stack starts
+ * in lkR_entry, which calls lkR_main(co) */
+
+#ifdef __APPLE__
+# define LKR_FUNC(name) ".globl _" name "\n.weak_definition _" name "\n" \
+    ".private_extern _" name "\n_" name ":\n"
+#else
+# define LKR_FUNC(name) ".weak " name "\n.hidden " name "\n" \
+    ".type " name ", %function\n" name ":\n"
+#endif
+
+#if defined(__x86_64__)
+
+__asm__ (
+    ".text\n"
+    ".p2align 4\n"
+    LKR_FUNC("lkR_switch")
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".p2align 4\n"
+    LKR_FUNC("lkR_entry")
+    "movq %r12, %rdi\n"
+    "callq *%r13\n"
+    "ud2\n");
+
+#define LKR_FRAME 8 /* words lkR_switch keeps on a stack */
+
+static void lkR_initframe (void **sp, lk_Coroutine *co, lkR_Main *f) {
+    extern void lkR_entry (void);
+    void (*entry) (void) = lkR_entry;
+    ((unsigned*)sp)[0] = 0x1F80; /* default MXCSR */
+    ((unsigned*)sp)[1] = 0x037F; /* and x87 control word */
+    memcpy(&sp[3], &f, sizeof(f)); /* r13 */
+    sp[4] = co;                    /* r12 */
+    memcpy(&sp[7], &entry, sizeof(entry)); /* return address */
+}
+
+#else /* __aarch64__ */
+
+__asm__ (
+    ".text\n"
+    ".p2align 2\n"
+    LKR_FUNC("lkR_switch")
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".p2align 2\n"
+    LKR_FUNC("lkR_entry")
+    "mov x0, x19\n"
+    "blr x20\n"
+    "brk #0\n");
+
+#define LKR_FRAME 20 /* words lkR_switch keeps on a stack */
+
+static void lkR_initframe (void **sp, lk_Coroutine *co, lkR_Main *f) {
+    extern void lkR_entry (void);
+    void (*entry) (void) = lkR_entry;
+    sp[0] = co;                    /* x19 */
+    memcpy(&sp[1], &f, sizeof(f)); /* x20 */
+    memcpy(&sp[11], &entry, sizeof(entry)); /* x30 */
+}
+
+#endif
+
+extern void lkR_switch (void **from, void *to);
+
+static lk_Coroutine *lkR_alloc (lk_State *S) {
+    lk_Coroutine *co = lkR_newstack(S);
+    void **sp;
+    if (co == NULL) return NULL;
+    /* the frame lkR_switch pops to enter lkR_entry, 16-byte aligned */
+    sp = (void**)co - LKR_FRAME;
+    memset(sp, 0, LKR_FRAME * sizeof(void*));
+    lkR_initframe(sp, co, lkR_main);
+    co->sp = sp;
+    return co;
+}
+
+static void lkR_switchin (lk_Cache *cache, lk_Coroutine *co)
+{ (void)cache; lkR_switch(&co->caller, co->sp); }
+
+static void lkR_switchout (lk_Coroutine *co)
+{ lkR_switch(&co->sp, co->caller); }
+
+#else /* LK_NO_COROUTINE: handlers always run on the worker stack */
+
+static lk_Coroutine *lkR_alloc (lk_State *S) { (void)S, (void)lkR_main; return NULL; }
+static void lkR_dealloc (lk_State *S, lk_Coroutine *co) { (void)S, (void)co; }
+static void lkR_switchin (lk_Cache *cache, lk_Coroutine *co) { (void)cache, (void)co; }
+static void lkR_switchout (lk_Coroutine *co) { (void)co; }
+
+#endif
+
+static lk_Coroutine *lkR_get (lk_State *S, lk_Cache *cache) {
+    lk_Coroutine *co;
+    if ((co = cache->spare) != NULL) {
+        cache->spare = NULL;
+        return co;
+    }
+    lk_lock(S->pool_lock);
+    if ((co = S->coroutines) != NULL) {
+        S->coroutines = co->next;
+        --S->ncoroutines;
+    }
+    lk_unlock(S->pool_lock);
+    return co != NULL ? co : lkR_alloc(S);
+}
+
+static void lkR_put (lk_State *S, lk_Cache *cache, lk_Coroutine *co) {
+    if (cache != NULL && cache->spare == NULL) {
+        cache->spare = co;
+        return;
+    }
+    lk_lock(S->pool_lock);
+    if (S->ncoroutines < LK_MAX_FREESTACKS) {
+        co->next = S->coroutines;
+        S->coroutines = co;
+        ++S->ncoroutines;
+        co = NULL;
+    }
+    lk_unlock(S->pool_lock);
+    if (co != NULL) lkR_dealloc(S, co);
+}
+
+static void lkR_closecache (lk_State *S, lk_Cache *cache) {
+    if (cache->spare != NULL) lkR_put(S, NULL, cache->spare);
+    cache->spare = NULL;
+#ifdef LK_COROUTINE_FIBER
+    if (cache->fiber != NULL) ConvertFiberToThread();
+    cache->fiber = NULL;
+#endif
+}
+
+static void lkR_freepool (lk_State *S) {
+    while (S->coroutines != NULL) {
+        lk_Coroutine *co = S->coroutines;
+        S->coroutines = co->next;
+        lkR_dealloc(S, co);
+    }
+    S->ncoroutines = 0;
+}
+
+static void lkR_link (lk_Coroutine **list, lk_Coroutine *co) {
+    lk_Coroutine *head = *list;
+    co->list = list;
+    if (head == NULL)
+        *list = co->prev = co->next = co;
+    else {
+        co->next = head;
+        co->prev = head->prev;
+        head->prev->next = co;
+        head->prev = co;
+    }
+}
+
+static void lkR_unlink (lk_Coroutine *co) {
+    lk_Coroutine **list = co->list;
+    if (co->next == co)
+        *list = NULL;
+    else {
+        co->prev->next = co->next;
+        co->next->prev = co->prev;
+        if (*list == co) *list = co->next;
+    }
+    co->list = NULL;
+}
+
+static void lkR_dropall (lk_State *S, lk_Service *svr) {
+    lk_Slot *slot;
+    lk_Coroutine *co;
+    /* no worker left to resume them: their stacks just go away */
+    for (slot = svr->slots; slot != NULL; slot = slot->next)
+        while ((co = slot->waiting) != NULL) {
+            lkR_unlink(co);
+            if (co->timed) (void)lkT_stoptimer(S, &co->timer);
+            lkR_dealloc(S, co);
+        }
+    while ((co = svr->sleeping) != NULL) {
+        lkR_unlink(co);
+        if (co->timed) (void)lkT_stoptimer(S, &co->timer);
+        lkR_dealloc(S, co);
+    }
+    svr->nsuspended = 0;
+}
+
+
+/* slot/poll routines */
+
+#define lkP_ispoll(obj)   ((((lk_Slot*)(obj))->flags & 0x01) != 0)
+#define lkP_issvr(obj)    ((((lk_Slot*)(obj))->flags & 0x02) != 0)
+#define lkP_isweak(obj)   ((((lk_Slot*)(obj))->flags & 0x04) != 0)
+#define lkP_isdead(obj)   ((((lk_Slot*)(obj))->flags & 0x08) != 0)
+#define lkP_isevent(obj)  ((((lk_Slot*)(obj))->flags & 0x10) != 0)
+
+#define lkP_setpoll(obj)   (((lk_Slot*)(obj))->flags |= 0x01)
+#define lkP_setsvr(obj)    (((lk_Slot*)(obj))->flags |= 0x02)
+#define lkP_setweak(obj)   (((lk_Slot*)(obj))->flags |= 0x04)
+#define lkP_setdead(obj)   (((lk_Slot*)(obj))->flags |= 0x08)
+#define lkP_setevent(obj)  (((lk_Slot*)(obj))->flags |= 0x10)
+
+#define lkP_getter(name, type, field) \
+LK_API type lk_##name (lk_Slot *slot) { return slot ? slot->field : NULL; }
+#define lkP_setter(name, type, field) \
+LK_API void lk_set##name (lk_Slot *s, type v) { if (s) s->field = v; }
+lkP_getter(name,        const char *, name     )
+lkP_getter(service,     lk_Service *, service  )
+lkP_getter(state,       lk_State *,   S        )
+lkP_getter(data,        void *,       userdata )
+lkP_setter(data,        void *,       userdata )
+lkP_getter(slothandler, lk_Handler *, handler  )
+lkP_setter(slothandler, lk_Handler *, handler  )
+lkP_getter(refactor,    lk_Handler *, refactor )
+lkP_setter(refactor,    lk_Handler *, refactor )
+#undef lkP_getter
+#undef lkP_setter
+
+LK_API lk_Slot *lk_current (lk_State *S)
+{ lk_Context *ctx = lk_context(S); return ctx ? ctx->current : &S->root.slot; }
+
+LK_API size_t lk_expired (lk_Slot *slot)
+{ return slot ? (size_t)lk_atomicload(&slot->nexpired) : 0; }
+
+static void lkP_name (char *buff, const char *svr, const char *name) {
+    size_t svrlen = strlen(svr);
+    assert(svrlen < LK_MAX_NAMESIZE);
+    memcpy(buff, svr, svrlen); buff += svrlen;
+    if (name != NULL) {
+        size_t namelen = strlen(name);
+        *buff++ = '.';
+        assert(namelen < LK_MAX_NAMESIZE);
+        memcpy(buff, name, namelen); buff += namelen;
+    }
+    *buff = '\0';
+}
+
+static lk_Slot *lkP_new (lk_State *S, lk_MemPool *pool, lk_Service *svr, const char *name) {
+    lk_Slot *slot = NULL;
     lk_lock(S->pool_lock);
     slot = (lk_Slot*)lk_poolalloc(S, pool);
     lk_unlock(S->pool_lock);
@@ -1094,7 +2537,7 @@ static lk_Slot *lkP_new (lk_State *S, lk_MemPool *pool, lk_Service *svr, const c
 
 static lk_Slot *lkP_register (lk_State *S, lk_Slot *slot) {
     lk_Entry *e = lk_settable(S, &S->slot_names, slot->name);
-    if (S->nthreads != 0 && (lk_Slot*)e->key == slot)
+    if (lk_atomicload(&S->nthreads) != 0 && (lk_Slot*)e->key == slot)
         return slot;
     if (&slot->service->slot == slot)
         lk_freelock(slot->service->lock);
@@ -1106,15 +2549,20 @@ static lk_Slot *lkP_register (lk_State *S, lk_Slot *slot) {
     return NULL;
 }
 
+static void lkP_closeevent (lk_State *S, lk_Poll *poll);
+static int  lkP_startpollers (lk_State *S);
+
 static int lkP_delpoll (lk_State *S, lk_Poll *poll) {
-    if (!lkP_isdead(poll)) {
+    if (!lkP_isdead(poll) && lkP_isevent(poll))
+        lkP_closeevent(S, poll);
+    else if (!lkP_isdead(poll)) {
         lk_lock(poll->lock);
         lkP_setdead(poll);
         lk_signal(poll->event);
         lk_unlock(poll->lock);
         lk_waitthread(poll->thread);
     }
-    if (poll->slot.service->pending != 0)
+    if (lk_atomicload(&poll->slot.service->pending) != 0)
         return LK_ERR;
     lk_freeevent(poll->event);
     lk_freelock(poll->lock);
@@ -1129,12 +2577,15 @@ static void lkP_poller (void *ud) {
     lk_Signal sig = LK_SIGNAL;
     lk_Poll  *poll = (lk_Poll*)ud;
     lk_State *S    = poll->slot.S;
+    lk_Cache  cache;
+    lkM_opencache(S, &cache);
     lk_pushcontext(S, &ctx, &poll->slot);
     lk_try(S, &ctx, poll->slot.handler(S, &poll->slot, &sig));
     lkP_setdead(poll);
     while (lk_wait(S, &sig, 0) == LK_OK)
         ;
     lk_popcontext(S, &ctx);
+    lkM_closecache(S, &cache);
 }
 
 static int lkP_startpoll (lk_Poll *poll) {
@@ -1142,7 +2593,8 @@ static int lkP_startpoll (lk_Poll *poll) {
     lkQ_init(&poll->signals);
     if (lk_initlock(&poll->lock)) {
         if (lk_initevent(&poll->event)) {
-            if (lk_initthread(&poll->thread, lkP_poller, poll))
+            if (lkP_isevent(poll) ? lkP_startpollers(S) == LK_OK
+                    : lk_initthread(&poll->thread, lkP_poller, poll))
                 return LK_OK;
             lk_freeevent(poll->event);
         }
@@ -1193,13 +2645,25 @@ LK_API lk_Slot *lk_newslot (lk_State *S, const char *name, lk_Handler *h, void *
     return slot;
 }
 
-LK_API lk_Slot *lk_newpoll (lk_State *S, const char *name, lk_Handler *h, void *ud) {
+LK_API lk_Slot *lk_newbatchslot (lk_State *S, const char *name, lk_BatchHandler *h, void *ud) {
+    lk_Slot *slot = lk_newslot(S, name, NULL, ud);
+    if (slot == NULL) return NULL;
+    /* nothing runs for the slot until the creating service returns */
+    slot->batchf = h;
+    return slot;
+}
+
+static void lkP_ontimeout (lk_State *S, lk_Timer *t);
+
+static lk_Slot *lkP_newpoll (lk_State *S, const char *name, lk_Handler *h, void *ud, int event) {
     lk_Service *svr = lk_self(S);
     lk_Poll *poll;
     if (S == NULL || svr == NULL || lkP_check(S, "newpoll", name) != LK_OK)
         return NULL;
     poll = (lk_Poll*)lkP_new(S, &S->polls, svr, name);
     lkP_setpoll(poll);
+    if (event) lkP_setevent(poll);
+    poll->timer.h = lkP_ontimeout;
     poll->slot.handler  = h;
     poll->slot.userdata = ud;
     if (lkP_startpoll(poll) != LK_OK) return NULL;
@@ -1216,6 +2680,12 @@ LK_API lk_Slot *lk_newpoll (lk_State *S, const char *name, lk_Handler *h, void *
     return &poll->slot;
 }
 
+LK_API lk_Slot *lk_newpoll (lk_State *S, const char *name, lk_Handler *h, void *ud)
+{ return lkP_newpoll(S, name, h, ud, 0); }
+
+LK_API lk_Slot *lk_neweventpoll (lk_State *S, const char *name, lk_Handler *h, void *ud)
+{ return lkP_newpoll(S, name, h, ud, 1); }
+
 LK_API lk_Slot *lk_slot (lk_State *S, const char *name) {
     lk_Service *svr = lk_self(S);
     lk_Slot *slot = NULL;
@@ -1246,6 +2716,31 @@ LK_API void lk_sethook (lk_Slot *slot, lk_Handler *h, void *ud) {
     lk_unlock(slot->service->lock);
 }
 
+LK_API int lk_setconflate (lk_Slot *slot, lk_ConflateKey *keyf) {
+    lk_State *S;
+    lk_Conflate *cf;
+    if (slot == NULL || lkP_ispoll(slot)) return LK_ERR;
+    if ((cf = slot->conflate) != NULL) {
+        /* queued entries are keyed by the old function */
+        int ret = LK_ERR;
+        lk_lock(cf->lock);
+        if (cf->count == 0) cf->keyf = keyf, ret = LK_OK;
+        lk_unlock(cf->lock);
+        return ret;
+    }
+    S = slot->S;
+    cf = (lk_Conflate*)S->allocf(S->alloc_ud, NULL, sizeof(lk_Conflate), 0);
+    if (cf == NULL) return LK_ERR;
+    memset(cf, 0, sizeof(lk_Conflate));
+    cf->keyf = keyf;
+    if (!lk_initlock(&cf->lock)) {
+        S->allocf(S->alloc_ud, cf, 0, sizeof(lk_Conflate));
+        return LK_ERR;
+    }
+    lk_atomicstorep(&slot->conflate, cf);
+    return LK_OK;
+}
+
 static void lkP_callhook (lk_Slot *slot, lk_Slot *sender, lk_Signal *sig) {
     lk_Handler *hookf = slot->hookf;
     void *ud;
@@ -1263,6 +2758,59 @@ static void lkP_callhook (lk_Slot *slot, lk_Slot *sender, lk_Signal *sig) {
     }
 }
 
+static void lkP_schedule (lk_State *S, lk_Poll *poll) {
+    /* under poll->lock: the ready list wakes one poll worker */
+    lk_lock(S->poller_lock);
+    poll->scheduled = 1;
+    poll->next_ready = NULL;
+    if (S->ready_last) S->ready_last->next_ready = poll;
+    else               S->ready_first = poll;
+    S->ready_last = poll;
+    lk_signal(S->poller_event);
+    lk_unlock(S->poller_lock);
+}
+
+
+/* mailbox: intrusive multi-producer/single-consumer queue (D. Vyukov) */
+
+static void lkB_init (lk_Mailbox *mb) {
+    mb->stub.next = NULL;
+    mb->head = mb->tail = &mb->stub;
+}
+
+static void lkB_push (lk_Mailbox *mb, lk_SignalNode *first, lk_SignalNode *last) {
+    lk_SignalNode *prev; /* first..last are already linked */
+    last->next = NULL;
+    prev = (lk_SignalNode*)lk_atomicxchgp(&mb->head, last);
+    lk_atomicstorep(&prev->next, first);
+}
+
+static int lkB_empty (lk_Mailbox *mb) {
+    return mb->tail == &mb->stub
+        && lk_atomicloadp(&mb->stub.next) == NULL
+        && lk_atomicloadp(&mb->head) == &mb->stub;
+}
+
+static lk_SignalNode *lkB_pop (lk_Mailbox *mb) {
+    lk_SignalNode *tail = mb->tail;
+    lk_SignalNode *next = (lk_SignalNode*)lk_atomicloadp(&tail->next);
+    if (tail == &mb->stub) {
+        if (next == NULL) return NULL;
+        mb->tail = tail = next;
+        next = (lk_SignalNode*)lk_atomicloadp(&next->next);
+    }
+    if (next == NULL) {
+        /* a sender swapped head but has not linked its node yet */
+        if (tail != (lk_SignalNode*)lk_atomicloadp(&mb->head))
+            return NULL;
+        lkB_push(mb, &mb->stub, &mb->stub);
+        next = (lk_SignalNode*)lk_atomicloadp(&tail->next);
+        if (next == NULL) return NULL;
+    }
+    mb->tail = next;
+    return tail;
+}
+
 
 /* emit signal */
 
@@ -1273,23 +2821,59 @@ LK_API int lk_emitstring (lk_Slot *slot, unsigned type, const char *s)
 
 static int lkE_srcdeletor (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
     (void)sender;
-    lk_lock(S->pool_lock);
-    lk_poolfree(&S->sources, sig->source);
-    lk_unlock(S->pool_lock);
+    lkM_free(S, sources, sig->source);
     return LK_OK;
 }
 
-static lk_SignalNode *lkE_newsignal (lk_State *S, lk_Slot *slot, const lk_Signal *sig) {
+static int lkE_calldeletor (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    lkM_free(S, calls, (lk_Call*)sig->source);
+    return LK_OK;
+}
+
+#define lkE_iscall(src) ((src) != NULL && (src)->deletor == lkE_calldeletor)
+
+/* a queued signal keeps its deadline in ttl, as the low bits of lkT_clock() */
+#define LK_DEADLINE_MASK 0xFFFFFFu
+
+static unsigned lkE_deadline (unsigned ttl) {
+    unsigned deadline;
+    if (ttl > LK_MAX_TTL) ttl = LK_MAX_TTL; /* or it reads as already late */
+    deadline = (lkT_clock() + ttl) & LK_DEADLINE_MASK;
+    return deadline != 0 ? deadline : 1;
+}
+
+static int lkE_expired (unsigned deadline, unsigned now) {
+    unsigned late = (now - deadline) & LK_DEADLINE_MASK;
+    return late != 0 && late <= LK_MAX_TTL;
+}
+
+/* inline payloads follow the node, behind a fake lk_Data header so that
+ * lk_len() works on them; the whole node comes from one size class */
+#define lkE_nodesize(sig) ((sig)->isinline ? sizeof(lk_SignalNode) \
+        + sizeof(lk_Data) + lk_len((lk_Data*)(sig)->data) : sizeof(lk_SignalNode))
+
+static lk_SignalNode *lkE_allocsignal (lk_State *S, lk_Slot *slot, const lk_Signal *sig) {
     lk_Slot *sender = lk_current(S);
+    size_t size = lkE_nodesize(sig);
     lk_SignalNode *node;
     lk_Source *src;
-    lk_lock(S->pool_lock);
-    node = (lk_SignalNode*)lk_poolalloc(S, &S->signals);
-    lk_unlock(S->pool_lock);
+    if (!sig->isinline)
+        node = (lk_SignalNode*)lkM_alloc(S, signals);
+    else {
+        lk_Data *data;
+        node = (lk_SignalNode*)lkM_smallalloc(S, lkM_sizeclass(size));
+        data = (lk_Data*)(node + 1);
+        data->refcount = 1;
+        data->size = data->len = (unsigned)lk_len((lk_Data*)sig->data);
+        memcpy(data + 1, sig->data, data->len);
+    }
+    lkM_charge(slot->service, (long)size);
     node->recipient = slot;
     node->sender    = sender;
     node->data      = *sig;
-    lk_retain(sender->service);
+    if (sig->isinline) node->data.data = (lk_Data*)(node + 1) + 1;
+    if (sig->ttl != 0) node->data.ttl = lkE_deadline(sig->ttl);
     if (node->data.source == NULL && sender->source != NULL) {
         node->data.source = sender->source;
         sender->source = NULL;
@@ -1302,9 +2886,16 @@ static lk_SignalNode *lkE_newsignal (lk_State *S, lk_Slot *slot, const lk_Signal
     return node;
 }
 
+static lk_SignalNode *lkE_newsignal (lk_State *S, lk_Slot *slot, const lk_Signal *sig) {
+    lk_SignalNode *node = lkE_allocsignal(S, slot, sig);
+    lk_retain(node->sender->service);
+    return node;
+}
+
 static void lkE_delsignal (lk_State *S, lk_SignalNode *node) {
     lk_Source *src = node->data.source;
     lk_Service *svr;
+    size_t size;
     if (node->data.isdata) lk_deldata(S, (lk_Data*)node->data.data);
     if (src != NULL && (svr = src->service) != NULL) {
         lk_freesource(src);
@@ -1312,31 +2903,207 @@ static void lkE_delsignal (lk_State *S, lk_SignalNode *node) {
     }
     if ((svr = node->sender->service) != NULL)
         lk_release(svr);
-    lk_lock(S->pool_lock);
-    lk_poolfree(&S->signals, node);
-    lk_unlock(S->pool_lock);
+    size = lkE_nodesize(&node->data);
+    lkM_charge(node->recipient->service, -(long)size);
+    if (node->data.isinline)
+        lkM_smallfree(S, lkM_sizeclass(size), node);
+    else
+        lkM_free(S, signals, node);
+}
+
+/* every path handing a node to a handler drops it past its deadline, or
+ * clears the deadline; *now is read once per batch, if needed */
+static int lkE_checkttl (lk_State *S, lk_SignalNode *node, unsigned *now) {
+    if (node->data.ttl == 0) return 1;
+    if (*now == 0) *now = lkT_clock();
+    if (lkE_expired(node->data.ttl, *now)) {
+        (void)lk_atomicinc(&node->recipient->nexpired);
+        lkE_delsignal(S, node);
+        return 0;
+    }
+    node->data.ttl = 0;
+    return 1;
+}
+
+/* mailbox bounds: full and the lists it guards change under svr->lock */
+
+static void lkE_addrefused (lk_State *S, lk_Service *svr, lk_Service *sender) {
+    unsigned i;
+    for (i = 0; i < svr->nrefused; ++i)
+        if (svr->refused[i] == sender) return;
+    if (svr->nrefused == svr->refused_size) {
+        unsigned size = svr->refused_size ? svr->refused_size*2 : 4;
+        lk_Service **refused = (lk_Service**)S->allocf(S->alloc_ud,
+                svr->refused, size*sizeof(lk_Service*),
+                svr->refused_size*sizeof(lk_Service*));
+        if (refused == NULL) return; /* it just misses the notification */
+        svr->refused = refused, svr->refused_size = size;
+    }
+    lk_retain(sender);
+    svr->refused[svr->nrefused++] = sender;
 }
 
-static int lkE_emitS (lk_Slot *slot, lk_SignalNode *node) {
+static unsigned lkE_clearfull (lk_Service *svr, lk_Service ***refused, unsigned *size) {
+    lk_EmitWaiter *waiter;
+    unsigned n = svr->nrefused;
+    (void)lk_atomicxchg(&svr->full, 0);
+    for (waiter = svr->waiters; waiter != NULL; waiter = waiter->next)
+        lk_signal(waiter->event);
+    svr->waiters  = NULL;
+    *refused      = svr->refused;
+    *size         = svr->refused_size;
+    svr->refused  = NULL;
+    svr->nrefused = svr->refused_size = 0;
+    return n;
+}
+
+static void lkE_notifyrefused (lk_State *S, lk_Service *svr, lk_Service **refused, unsigned n, unsigned size) {
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+        char name[LK_MAX_NAMESIZE*2];
+        lk_Signal sig = LK_SIGNAL;
+        lk_Slot *slot;
+        lkP_name(name, refused[i]->slot.name, LK_SLOTNAME_UNBLOCK);
+        sig.type     = LK_UNBLOCK_TYPE;
+        sig.data     = lkP_isdead(svr) ? NULL : svr;
+        sig.isurgent = 1;
+        if (!lkP_isdead(refused[i])
+                && (slot = lkP_findslotG(S, name)) != NULL)
+            lk_emit(slot, &sig);
+        lk_release(refused[i]);
+    }
+    if (refused != NULL)
+        S->allocf(S->alloc_ud, refused, 0, size*sizeof(lk_Service*));
+}
+
+static void lkE_drained (lk_State *S, lk_Service *svr) {
+    lk_Service **refused = NULL;
+    unsigned n = 0, size = 0;
+    lk_lock(svr->lock);
+    if (lk_atomicload(&svr->full) && (svr->mailbox_high == 0
+                || lk_atomicload(&svr->nqueued) <= (long)svr->mailbox_low))
+        n = lkE_clearfull(svr, &refused, &size);
+    lk_unlock(svr->lock);
+    lkE_notifyrefused(S, svr, refused, n, size);
+}
+
+/* reserves room for count signals in nqueued, or refuses them */
+static int lkE_admit (lk_State *S, lk_Service *svr, int count) {
+    lk_Service *sender;
+    while (lk_atomicload(&svr->full) == 0) {
+        long queued = lk_atomicload(&svr->nqueued);
+        if (queued > 0 && queued + count > (long)svr->mailbox_high)
+            break;
+        if (lk_atomiccas(&svr->nqueued, queued, queued + count))
+            return LK_OK;
+    }
+    lk_lock(svr->lock);
+    (void)lk_atomicxchg(&svr->full, 1);
+    /* the consumer may have drained it before it could see full */
+    if (lk_atomicload(&svr->nqueued) <= (long)svr->mailbox_low) {
+        lk_Service **refused;
+        unsigned n, size;
+        /* before full clears, while the others wait on the lock */
+        (void)lk_atomicadd(&svr->nqueued, count);
+        n = lkE_clearfull(svr, &refused, &size);
+        lk_unlock(svr->lock);
+        lkE_notifyrefused(S, svr, refused, n, size);
+        return LK_OK;
+    }
+    if ((sender = lk_self(S)) != NULL && sender != svr)
+        lkE_addrefused(S, svr, sender);
+    lk_unlock(svr->lock);
+    return LK_BUSY;
+}
+
+static void lkE_bulkrelease (lk_Service *svr, long count) {
+    long pending = lk_atomicadd(&svr->pending, -count);
+    assert(pending >= 0);
+    if (pending == 0 && lkP_isdead(svr)) lkS_active(svr->slot.S, svr);
+}
+
+static void lkE_delsignals (lk_State *S, lk_SignalNode **nodes, int n) {
+    lk_Service *recipient = nodes[0]->recipient->service, *svr = NULL;
+    long size = 0, count = 0;
+    int i;
+    for (i = 0; i < n; ++i) { /* no sources here, see lkS_batchable() */
+        lk_SignalNode *node = nodes[i];
+        size_t nodesize = lkE_nodesize(&node->data);
+        if (node->data.isdata) lk_deldata(S, (lk_Data*)node->data.data);
+        if (node->sender->service != svr) {
+            if (count != 0) lkE_bulkrelease(svr, count);
+            svr = node->sender->service, count = 0;
+        }
+        if (svr != NULL) ++count;
+        size += (long)nodesize;
+        if (node->data.isinline)
+            lkM_smallfree(S, lkM_sizeclass(nodesize), node);
+        else
+            lkM_free(S, signals, node);
+    }
+    if (count != 0) lkE_bulkrelease(svr, count);
+    lkM_charge(recipient, -size);
+}
+
+static void lkE_pushlanes (lk_Service *svr, lk_SignalNode *node, lk_SignalNode *last) {
+    lk_SignalNode *first[2], *tail[2], *next;
+    first[0] = first[1] = tail[0] = tail[1] = NULL;
+    for (;; node = next) { /* split the chain, keeping order in a lane */
+        int lane = node->data.isurgent;
+        next = node->next;
+        if (tail[lane] != NULL) tail[lane]->next = node;
+        else first[lane] = node;
+        tail[lane] = node;
+        if (node == last) break;
+    }
+    if (first[0] != NULL) lkB_push(&svr->mailbox, first[0], tail[0]);
+    if (first[1] != NULL) lkB_push(&svr->express, first[1], tail[1]);
+}
+
+static int lkE_emitS (lk_Slot *slot, lk_SignalNode *node, lk_SignalNode *last, int count) {
     lk_Service *svr = slot->service;
+    lk_State *S = svr->slot.S;
     int ret = LK_ERR;
-    lk_lock(svr->lock);
-    if (svr->slot.S->nthreads != 0 && !lkP_isdead(svr)) {
+    if (lk_atomicload(&S->nthreads) == 0) return LK_ERR;
+    if (svr->memquota > 0 && svr->quotaf == NULL
+            && lk_atomicload(&svr->memused) > svr->memquota)
+        return LK_QUOTA; /* over the soft quota: push back on senders */
+    lk_retain(svr); /* hold svr until the node is in its mailbox */
+    if (!lkP_isdead(svr)) {
         lk_Poll *poll = (lk_Poll*)slot;
         if (!lkP_ispoll(slot)) {
-            lkQ_enqueue(&svr->signals, node);
-            lkS_active(svr->slot.S, svr);
-            ret = LK_OK;
+            /* urgent signals alone always get in */
+            if (svr->mailbox_high == 0 || (node == last && node->data.isurgent))
+                (void)lk_atomicadd(&svr->nqueued, count), ret = LK_OK;
+            else
+                ret = lkE_admit(S, svr, count);
+            if (ret == LK_OK) {
+                lkE_pushlanes(svr, node, last);
+                lkS_active(S, svr);
+            }
+        }
+        else if (lkP_isevent(poll)) {
+            lk_lock(poll->lock);
+            if (!lkP_isdead(poll)) {
+                *poll->signals.plast = node;
+                poll->signals.plast = &last->next;
+                last->next = NULL;
+                if (!poll->scheduled) lkP_schedule(S, poll);
+                ret = LK_OK;
+            }
+            lk_unlock(poll->lock);
         }
         else if (!lkP_isdead(poll)) {
             lk_lock(poll->lock);
-            lkQ_enqueue(&poll->signals, node);
+            *poll->signals.plast = node;
+            poll->signals.plast = &last->next;
+            last->next = NULL;
             lk_signal(poll->event);
             lk_unlock(poll->lock);
             ret = LK_OK;
         }
     }
-    lk_unlock(svr->lock);
+    lk_release(svr);
     return ret;
 }
 
@@ -1363,23 +3130,17 @@ LK_API void lk_initsource (lk_State *S, lk_Source *src, lk_Handler *h, void *ud)
 LK_API void lk_usesource (lk_Source *src) {
     assert(src && src->service);
     if (src->service == NULL) return;
-    lk_lock(src->service->lock);
-    ++src->refcount;
-    lk_unlock(src->service->lock);
+    (void)lk_atomicinc(&src->refcount);
 }
 
 LK_API void lk_freesource (lk_Source *src) {
     lk_Signal sig = LK_SIGNAL;
     lk_State *S;
-    unsigned refcount = 0;
     sig.source = src;
     assert(src->service != NULL);
     if (src->service == NULL) return;
     S = src->service->slot.S;
-    lk_lock(src->service->lock);
-    if (src->refcount >= 1) refcount = --src->refcount;
-    lk_unlock(src->service->lock);
-    if (refcount == 0 && src->deletor != NULL) {
+    if (lk_atomicdec(&src->refcount) <= 0 && src->deletor != NULL) {
         lk_Context ctx;
         lk_pushcontext(S, &ctx, &src->service->slot);
         lk_try(S, &ctx, src->deletor(S, NULL, &sig));
@@ -1391,24 +3152,248 @@ LK_API void lk_setcallback (lk_State *S, lk_Handler *h, void *ud) {
     lk_Slot *slot = lk_current(S);
     lk_Source *src;
     if (slot->source != NULL) lk_freesource(slot->source);
-    lk_lock(S->pool_lock);
-    src = (lk_Source*)lk_poolalloc(S, &S->sources);
-    lk_unlock(S->pool_lock);
+    src = (lk_Source*)lkM_alloc(S, sources);
     lk_initsource(S, src, h, ud);
     src->deletor  = lkE_srcdeletor;
     slot->source  = src;
 }
 
+typedef struct lk_EmitEntry {
+    const void    *key; /* destination service, or poll */
+    int            index;
+} lk_EmitEntry;
+
+static int lkE_compentry (const void *lhs, const void *rhs) {
+    const lk_EmitEntry *l = (const lk_EmitEntry*)lhs;
+    const lk_EmitEntry *r = (const lk_EmitEntry*)rhs;
+    if (l->key != r->key)
+        return (const char*)l->key < (const char*)r->key ? -1 : 1;
+    return l->index - r->index; /* keep the order within a destination */
+}
+
+static int lkE_emitgroup (lk_State *S, lk_SignalNode *first, lk_SignalNode *last, int count) {
+    lk_SignalNode *node = first, *next;
+    if (lkE_emitS(first->recipient, first, last, count) == LK_OK)
+        return count;
+    for (;; node = next) {
+        next = node->next;
+        lkE_delsignal(S, node);
+        if (node == last) break;
+    }
+    return 0;
+}
+
+static void lkE_bulkretain (lk_State *S, int count) {
+    lk_Service *sender = lk_self(S); /* one atomic for the whole batch */
+    if (sender != NULL && count > 0)
+        (void)lk_atomicadd(&sender->pending, count);
+}
+
+static int lkE_emitnodes (lk_State *S, lk_SignalNode **nodes, int n) {
+    size_t size = n * sizeof(lk_EmitEntry);
+    lk_EmitEntry *entries;
+    int i, j, count = 0, istmp = 1;
+    if (n <= 0) return 0;
+    if ((entries = (lk_EmitEntry*)lkM_tmpalloc(S, size)) == NULL)
+        entries = (lk_EmitEntry*)lk_malloc(S, size), istmp = 0;
+    for (i = 0; i < n; ++i) {
+        lk_Slot *slot = nodes[i]->recipient;
+        entries[i].key = lkP_ispoll(slot) ? (void*)slot : (void*)slot->service;
+        entries[i].index = i;
+    }
+    qsort(entries, n, sizeof(lk_EmitEntry), lkE_compentry);
+    for (i = 0; i < n; i = j) { /* one splice and activation each */
+        lk_SignalNode *first = nodes[entries[i].index], *last = first;
+        for (j = i + 1; j < n && entries[j].key == entries[i].key; ++j)
+            last = last->next = nodes[entries[j].index];
+        count += lkE_emitgroup(S, first, last, j - i);
+    }
+    if (!istmp) lk_free(S, entries, size);
+    return count;
+}
+
+static lk_Cache *lkE_outbox (lk_State *S) {
+    lk_Cache *cache;
+    if (!S->outbox) return NULL;
+    cache = (lk_Cache*)lk_gettls(S->cache_index);
+    return cache != NULL && cache->buffering ? cache : NULL;
+}
+
+static void lkE_flushoutbox (lk_State *S, lk_Cache *cache) {
+    int n = (int)cache->noutbox;
+    cache->noutbox = 0;
+    lkE_emitnodes(S, cache->outbox, n);
+}
+
+static int lkE_postoutbox (lk_State *S, lk_Cache *cache, lk_SignalNode *node) {
+    if (cache->noutbox == cache->outbox_size) {
+        unsigned size = cache->outbox_size ? cache->outbox_size*2 : 16;
+        lk_SignalNode **outbox;
+        if (cache->noutbox >= LK_OUTBOX_SIZE)
+            lkE_flushoutbox(S, cache);
+        else if ((outbox = (lk_SignalNode**)S->allocf(S->alloc_ud,
+                        cache->outbox, size*sizeof(lk_SignalNode*),
+                        cache->outbox_size*sizeof(lk_SignalNode*))) != NULL)
+            cache->outbox = outbox, cache->outbox_size = size;
+        else
+            return LK_ERR;
+    }
+    cache->outbox[cache->noutbox++] = node;
+    return LK_OK;
+}
+
+/* conflation: entries change under cf->lock, and a node leaves the table
+ * before its handler reads it */
+
+static size_t lkE_conflatehash (unsigned type, size_t key) {
+    size_t h = key ^ ((size_t)type * 0x9E3779B9u);
+    h ^= h >> 15, h *= 0x85EBCA6Bu, h ^= h >> 13;
+    return h;
+}
+
+static lk_ConflateEntry *lkE_findentry (lk_Conflate *cf, unsigned type, size_t key) {
+    size_t mask = cf->size - 1, i = lkE_conflatehash(type, key) & mask;
+    for (; cf->entries[i].node != NULL; i = (i + 1) & mask) {
+        lk_ConflateEntry *e = &cf->entries[i];
+        if (e->key == key && e->node->data.type == type)
+            return e;
+    }
+    return &cf->entries[i];
+}
+
+static void lkE_delentry (lk_Conflate *cf, lk_ConflateEntry *e) {
+    size_t mask = cf->size - 1, i = e - cf->entries, j = i;
+    for (;;) { /* shift back the entries that probed past the hole */
+        size_t home;
+        j = (j + 1) & mask;
+        if (cf->entries[j].node == NULL) break;
+        home = lkE_conflatehash(cf->entries[j].node->data.type,
+                cf->entries[j].key) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cf->entries[i] = cf->entries[j];
+            i = j;
+        }
+    }
+    cf->entries[i].node = NULL;
+    --cf->count;
+}
+
+static int lkE_growentries (lk_State *S, lk_Conflate *cf) {
+    size_t i, size = cf->size ? cf->size*2 : 16;
+    lk_ConflateEntry *entries = (lk_ConflateEntry*)S->allocf(S->alloc_ud,
+            NULL, size*sizeof(lk_ConflateEntry), 0);
+    lk_ConflateEntry *old = cf->entries;
+    size_t oldsize = cf->size;
+    if (entries == NULL) return LK_ERR;
+    memset(entries, 0, size*sizeof(lk_ConflateEntry));
+    cf->entries = entries, cf->size = size;
+    for (i = 0; i < oldsize; ++i)
+        if (old[i].node != NULL)
+            *lkE_findentry(cf, old[i].node->data.type, old[i].key) = old[i];
+    if (old != NULL)
+        S->allocf(S->alloc_ud, old, 0, oldsize*sizeof(lk_ConflateEntry));
+    return LK_OK;
+}
+
+static void lkE_freeconflate (lk_State *S, lk_Slot *slot) {
+    lk_Conflate *cf = slot->conflate;
+    if (cf == NULL) return;
+    slot->conflate = NULL;
+    lk_freelock(cf->lock);
+    if (cf->entries != NULL)
+        S->allocf(S->alloc_ud, cf->entries, 0, cf->size*sizeof(lk_ConflateEntry));
+    S->allocf(S->alloc_ud, cf, 0, sizeof(lk_Conflate));
+}
+
+static void lkE_unconflate (lk_Slot *slot, lk_SignalNode *node) {
+    lk_Conflate *cf = slot->conflate;
+    lk_ConflateEntry *e;
+    lk_lock(cf->lock);
+    if (cf->count != 0) {
+        e = lkE_findentry(cf, node->data.type,
+                cf->keyf ? cf->keyf(&node->data) : 0);
+        if (e->node == node) lkE_delentry(cf, e);
+    }
+    lk_unlock(cf->lock);
+}
+
+static void lkE_replace (lk_State *S, lk_SignalNode *node, const lk_Signal *sig) {
+    lk_Slot *sender = lk_current(S);
+    if (node->data.isdata) lk_deldata(S, (lk_Data*)node->data.data);
+    if (sig->isdata) lk_usedata(S, (lk_Data*)sig->data);
+    node->data.data   = sig->data;
+    node->data.isdata = sig->isdata;
+    node->data.isack  = sig->isack;
+    node->data.ttl    = sig->ttl ? lkE_deadline(sig->ttl) : 0;
+    if (node->sender != sender) {
+        lk_Service *old = node->sender->service;
+        lk_retain(sender->service);
+        node->sender = sender;
+        lk_release(old);
+    }
+}
+
+static int lkE_conflate (lk_Slot *slot, const lk_Signal *sig) {
+    lk_State *S = slot->S;
+    lk_Conflate *cf = slot->conflate;
+    lk_ConflateEntry *e;
+    lk_SignalNode *node;
+    size_t key;
+    int ret;
+    lk_lock(cf->lock);
+    key = cf->keyf ? cf->keyf(sig) : 0; /* keyf changes under the lock */
+    if (cf->count >= cf->size/4*3) (void)lkE_growentries(S, cf);
+    e = cf->size != 0 ? lkE_findentry(cf, sig->type, key) : NULL;
+    if (e != NULL && (node = e->node) != NULL && !node->data.isinline
+            && node->data.source == NULL && !lkP_isdead(slot->service)) {
+        lkE_replace(S, node, sig);
+        lk_unlock(cf->lock);
+        return LK_OK;
+    }
+    /* out of memory: just queue it, but keep a hole to end the probes */
+    if (e != NULL && e->node == NULL && cf->count + 1 >= cf->size)
+        e = NULL;
+    /* the entry must be there before the consumer can see the node */
+    node = lkE_newsignal(S, slot, sig);
+    if (e != NULL) {
+        if (e->node == NULL) ++cf->count;
+        e->key  = key;
+        e->node = node;
+    }
+    if ((ret = lkE_emitS(slot, node, node, 1)) != LK_OK) {
+        if (e != NULL) lkE_delentry(cf, e);
+        lkE_delsignal(S, node);
+    }
+    lk_unlock(cf->lock);
+    return ret;
+}
+
 LK_API int lk_emit (lk_Slot *slot, const lk_Signal *sig) {
     lk_SignalNode *node;
+    lk_Cache *cache;
+    int ret;
     assert(slot != NULL);
     if (slot == NULL || sig == NULL) return LK_ERR;
+    /* whatever skips the outbox goes after the emits buffered there,
+     * only urgent signals may overtake them */
+    cache = sig->isurgent ? NULL : lkE_outbox(slot->S);
+    if (slot->conflate != NULL && !sig->isinline && sig->source == NULL
+            && lk_current(slot->S)->source == NULL) {
+        if (cache != NULL && cache->noutbox != 0)
+            lkE_flushoutbox(slot->S, cache);
+        return lkE_conflate(slot, sig);
+    }
     node = lkE_newsignal(slot->S, slot, sig);
-    if (lkE_emitS(slot, node) != LK_OK) {
-        lkE_delsignal(slot->S, node);
-        return LK_ERR;
+    if (cache != NULL) {
+        /* bounded mailboxes must answer now, not when the batch ends */
+        if (slot->service->mailbox_high == 0
+                && lkE_postoutbox(slot->S, cache, node) == LK_OK)
+            return LK_OK;
+        if (cache->noutbox != 0) lkE_flushoutbox(slot->S, cache);
     }
-    return LK_OK;
+    if ((ret = lkE_emitS(slot, node, node, 1)) != LK_OK)
+        lkE_delsignal(slot->S, node);
+    return ret;
 }
 
 LK_API int lk_broadcast (lk_State *S, const char *name, const lk_Signal *sig) {
@@ -1418,6 +3403,7 @@ LK_API int lk_broadcast (lk_State *S, const char *name, const lk_Signal *sig) {
     if (node != NULL) {
         lk_Table t;
         lk_Entry *e = NULL;
+        node->data.ttl = sig ? sig->ttl : 0; /* each emit sets a deadline */
         lk_lock(S->lock);
         lk_copytable(S, &t, &S->slot_names);
         lk_unlock(S->lock);
@@ -1432,36 +3418,306 @@ LK_API int lk_broadcast (lk_State *S, const char *name, const lk_Signal *sig) {
     return count;
 }
 
+LK_API int lk_emitinline (lk_Slot *slot, unsigned type, const void *p, size_t len) {
+    lk_Signal sig = LK_SIGNAL;
+    struct { lk_Data h; char buff[LK_INLINE_SIZE]; } payload;
+    if (slot == NULL) return LK_ERR;
+    if (len > LK_INLINE_SIZE) /* too big, it goes with an lk_Data */
+        return lk_emitdata(slot, type, lk_newlstring(slot->S, (const char*)p, len));
+    payload.h.refcount = 1;
+    payload.h.size = payload.h.len = (unsigned)len;
+    memcpy(payload.buff, p, len);
+    sig.type     = type & LK_TYPE_MASK;
+    sig.isinline = 1;
+    sig.isack    = (type & LK_RESPONSE_TYPE) != 0;
+    sig.isurgent = (type & LK_URGENT_TYPE) != 0;
+    sig.data     = payload.buff;
+    return lk_emit(slot, &sig);
+}
+
+LK_API int lk_emitn (lk_Slot *slot, const lk_Signal *sigs, int n) {
+    lk_SignalNode *first = NULL, *last = NULL;
+    lk_Cache *cache;
+    int i;
+    if (slot == NULL || sigs == NULL || n <= 0) return 0;
+    if ((cache = lkE_outbox(slot->S)) != NULL && cache->noutbox != 0)
+        lkE_flushoutbox(slot->S, cache);
+    for (i = 0; i < n; ++i) {
+        lk_SignalNode *node = lkE_allocsignal(slot->S, slot, &sigs[i]);
+        if (last == NULL) first = node;
+        else last->next = node;
+        last = node;
+    }
+    lkE_bulkretain(slot->S, n);
+    return lkE_emitgroup(slot->S, first, last, n);
+}
+
+LK_API int lk_emitv (lk_State *S, const lk_Slot **slots, const lk_Signal *sigs, int n) {
+    size_t size = n * sizeof(lk_SignalNode*);
+    lk_SignalNode **nodes;
+    lk_Cache *cache;
+    int i, m = 0, count, istmp = 1;
+    if (S == NULL || slots == NULL || sigs == NULL || n <= 0) return 0;
+    if ((cache = lkE_outbox(S)) != NULL && cache->noutbox != 0)
+        lkE_flushoutbox(S, cache); /* keep the order of earlier emits */
+    if ((nodes = (lk_SignalNode**)lkM_tmpalloc(S, size)) == NULL)
+        nodes = (lk_SignalNode**)lk_malloc(S, size), istmp = 0;
+    for (i = 0; i < n; ++i) {
+        if (slots[i] == NULL) continue;
+        nodes[m++] = lkE_allocsignal(S, (lk_Slot*)slots[i], &sigs[i]);
+    }
+    lkE_bulkretain(S, m);
+    count = lkE_emitnodes(S, nodes, m);
+    if (!istmp) lk_free(S, nodes, size);
+    return count;
+}
+
 LK_API int lk_emitdata (lk_Slot *slot, unsigned type, lk_Data *data) {
     lk_Signal sig = LK_SIGNAL;
     if (slot == NULL) return LK_ERR;
     sig.type   = type & LK_TYPE_MASK;
     sig.isdata = 1;
     sig.isack  = (type & LK_RESPONSE_TYPE) != 0;
+    sig.isurgent = (type & LK_URGENT_TYPE) != 0;
     sig.data   = data;
     return lk_emit(slot, &sig);
 }
 
+LK_API int lk_emiturgent (lk_Slot *slot, const lk_Signal *sig) {
+    lk_Signal urgent;
+    if (sig == NULL) return LK_ERR;
+    urgent = *sig;
+    urgent.isurgent = 1;
+    return lk_emit(slot, &urgent);
+}
+
+static void lkE_delwaiter (lk_Service *svr, lk_EmitWaiter *waiter) {
+    lk_EmitWaiter **pw = &svr->waiters;
+    while (*pw != NULL && *pw != waiter)
+        pw = &(*pw)->next;
+    if (*pw != NULL) *pw = waiter->next;
+}
+
+LK_API int lk_emitwait (lk_Slot *slot, const lk_Signal *sig, int waitms) {
+    unsigned start = lkT_clock();
+    lk_Service *svr;
+    int ret;
+    if ((ret = lk_emit(slot, sig)) != LK_BUSY || waitms == 0)
+        return ret;
+    /* a worker must not sleep: the consumer may need it to drain */
+    if (lk_gettls(slot->S->worker_index) != NULL)
+        return LK_BUSY;
+    lk_retain(svr = slot->service);
+    do {
+        lk_EmitWaiter waiter;
+        int remain = -1;
+        if (waitms > 0
+                && (remain = waitms - (int)(lkT_clock() - start)) <= 0) {
+            ret = LK_TIMEOUT;
+            break;
+        }
+        if (!lk_initevent(&waiter.event)) {
+            ret = LK_ERR;
+            break;
+        }
+        lk_lock(svr->lock);
+        if (lk_atomicload(&svr->full)) {
+            waiter.next  = svr->waiters;
+            svr->waiters = &waiter;
+            lk_waitevent(&waiter.event, &svr->lock, remain);
+            lkE_delwaiter(svr, &waiter);
+        }
+        lk_unlock(svr->lock);
+        lk_freeevent(waiter.event);
+    } while ((ret = lk_emit(slot, sig)) == LK_BUSY);
+    lk_release(svr);
+    return ret;
+}
+
+/* event poll routines: polls without a thread, run by a few shared
+ * poll workers when signals come or their timeout passes */
+
+static void lkP_ontimeout (lk_State *S, lk_Timer *t) {
+    lk_Poll *poll = (lk_Poll*)((char*)t - offsetof(lk_Poll, timer));
+    (void)S;
+    lk_lock(poll->lock);
+    if (!lkP_isdead(poll)) {
+        poll->timedout = 1;
+        if (!poll->scheduled) lkP_schedule(poll->slot.S, poll);
+    }
+    lk_unlock(poll->lock);
+}
+
+static void lkP_runpoll (lk_State *S, lk_Poll *poll) {
+    lk_Handler *h = poll->slot.handler;
+    lk_SignalNode *node = NULL, *next;
+    lk_Context ctx;
+    unsigned now = 0;
+    int called = 0, timedout = 0, ret = 0;
+    lk_lock(poll->lock);
+    if (!lkP_isdead(poll)) {
+        lkQ_clear(&poll->signals, node);
+        timedout = poll->timedout;
+    }
+    poll->timedout = 0;
+    lk_unlock(poll->lock);
+    lk_pushcontext(S, &ctx, &poll->slot);
+    if (node == NULL && timedout) {
+        lk_try(S, &ctx, ret = h(S, &poll->slot, NULL));
+        called = 1;
+    }
+    for (; node != NULL; node = next) {
+        next = node->next;
+        if (!lkE_checkttl(S, node, &now)) continue;
+        ret = LK_OK;
+        lk_try(S, &ctx, ret = h(S, node->sender, &node->data));
+        lkP_callhook(&poll->slot, node->sender, &node->data);
+        lkE_delsignal(S, node);
+        called = 1;
+    }
+    lk_popcontext(S, &ctx);
+    lkM_endbatch(S);
+    /* the last call decides the timeout; nobody else touches the timer
+     * until running is clear */
+    if (called) {
+        (void)lkT_stoptimer(S, &poll->timer);
+        if (ret > 0) (void)lkT_starttimer(S, &poll->timer, (unsigned)ret);
+    }
+    lk_lock(poll->lock);
+    lk_lock(S->poller_lock);
+    poll->running = 0;
+    if (lkP_isdead(poll))
+        lk_signal(poll->event);
+    else if (!lkQ_empty(&poll->signals) || poll->timedout) {
+        poll->next_ready = NULL; /* more came while it ran */
+        if (S->ready_last) S->ready_last->next_ready = poll;
+        else               S->ready_first = poll;
+        S->ready_last = poll;
+    }
+    else poll->scheduled = 0;
+    lk_unlock(S->poller_lock);
+    lk_unlock(poll->lock);
+}
+
+static void lkP_pollworker (void *ud) {
+    lk_State *S = (lk_State*)ud;
+    lk_Cache cache;
+    lkM_opencache(S, &cache);
+    lk_lock(S->poller_lock);
+    while (!S->poller_stop) {
+        lk_Poll *poll = S->ready_first;
+        if (poll == NULL) {
+            /* timers fire here too, or they wait for a busy worker;
+             * timer handlers may take poller_lock */
+            lk_unlock(S->poller_lock);
+            (void)lkT_firetimers(S);
+            lk_lock(S->poller_lock);
+            if (S->ready_first == NULL && !S->poller_stop)
+                lk_waitevent(&S->poller_event, &S->poller_lock,
+                        lkT_waittime(S, -1));
+            continue;
+        }
+        if ((S->ready_first = poll->next_ready) == NULL)
+            S->ready_last = NULL;
+        poll->running = 1;
+        lk_unlock(S->poller_lock);
+        lkP_runpoll(S, poll);
+        (void)lkT_firetimers(S);
+        lk_lock(S->poller_lock);
+    }
+    lk_signal(S->poller_event); /* pass the stop on */
+    lk_unlock(S->poller_lock);
+    lkM_closecache(S, &cache);
+}
+
+static int lkG_configint (lk_State *S, const char *key, int defvalue);
+
+static int lkP_startpollers (lk_State *S) {
+    int count;
+    lk_lock(S->poller_lock);
+    if (S->npollers == 0 && !S->poller_stop) {
+        count = lkG_configint(S, "loki.pollers", LK_POLLERS);
+        if (count < 1) count = 1;
+        if (count > LK_MAX_POLLERS) count = LK_MAX_POLLERS;
+        while (S->npollers < count && lk_initthread(&S->pollers[S->npollers],
+                    lkP_pollworker, S))
+            ++S->npollers;
+    }
+    count = S->npollers;
+    lk_unlock(S->poller_lock);
+    return count != 0 ? LK_OK : LK_ERR;
+}
+
+static void lkP_stoppollers (lk_State *S) {
+    int i;
+    lk_lock(S->poller_lock);
+    S->poller_stop = 1;
+    lk_signal(S->poller_event);
+    lk_unlock(S->poller_lock);
+    for (i = 0; i < S->npollers; ++i)
+        lk_waitthread(S->pollers[i]);
+    S->npollers = 0;
+}
+
+static void lkP_closeevent (lk_State *S, lk_Poll *poll) {
+    lk_SignalNode *node, *next;
+    lk_Context ctx;
+    lk_lock(poll->lock);
+    lkP_setdead(poll);
+    lkQ_clear(&poll->signals, node);
+    lk_unlock(poll->lock);
+    lk_lock(S->poller_lock);
+    if (poll->scheduled && !poll->running) {
+        lk_Poll **pp = &S->ready_first, *prev = NULL;
+        while (*pp != NULL && *pp != poll)
+            prev = *pp, pp = &prev->next_ready;
+        if (*pp == poll && (*pp = poll->next_ready) == NULL)
+            S->ready_last = prev;
+    }
+    while (poll->running)
+        lk_waitevent(&poll->event, &S->poller_lock, -1);
+    lk_unlock(S->poller_lock);
+    (void)lkT_stoptimer(S, &poll->timer);
+    for (; node != NULL; node = next) {
+        next = node->next;
+        lkE_delsignal(S, node);
+    }
+    lk_pushcontext(S, &ctx, &poll->slot);
+    lk_try(S, &ctx, poll->slot.handler(S, NULL, NULL));
+    lk_popcontext(S, &ctx);
+}
+
+static int lkR_wait (lk_State *S, lk_Coroutine *co, lk_Signal *sig, int waitms);
+
 LK_API int lk_wait (lk_State *S, lk_Signal* sig, int waitms) {
     lk_Poll *poll = (lk_Poll*)lk_current(S);
     lk_Slot *slot = &poll->slot;
     lk_SignalNode *node = NULL;
-    if (poll == NULL || !lkP_ispoll(poll)) return LK_ERR;
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    unsigned now = 0;
+    if (cache != NULL && cache->running != NULL)
+        return lkR_wait(S, cache->running, sig, waitms);
+    if (poll == NULL || !lkP_ispoll(poll) || lkP_isevent(poll)) return LK_ERR;
     if (slot->current) {
         lkP_callhook(slot, slot->current->sender, &slot->current->data);
         lkE_delsignal(S, slot->current);
         slot->current = NULL;
     }
-    lk_lock(poll->lock);
-    if (sig) lkQ_dequeue(&poll->signals, node);
-    while (node == NULL && !lkP_isdead(poll)) {
-        int ret = lk_waitevent(&poll->event, &poll->lock, waitms);
+    lkM_endbatch(S); /* previous signal is done */
+    for (;;) { /* an expired one is dropped, and the wait starts again */
+        lk_lock(poll->lock);
         if (sig) lkQ_dequeue(&poll->signals, node);
-        if (ret != LK_OK || waitms >= 0) break;
+        while (node == NULL && !lkP_isdead(poll)) {
+            int ret = lk_waitevent(&poll->event, &poll->lock, waitms);
+            if (sig) lkQ_dequeue(&poll->signals, node);
+            if (ret != LK_OK || waitms >= 0) break;
+        }
+        lk_unlock(poll->lock);
+        if (node == NULL)
+            return lkP_isdead(poll) ? LK_ERR : LK_TIMEOUT;
+        if (lkE_checkttl(S, node, &now)) break;
+        node = NULL;
     }
-    lk_unlock(poll->lock);
-    if (node == NULL)
-        return lkP_isdead(poll) ? LK_ERR : LK_TIMEOUT;
     slot->current = node;
     if (sig) *sig = node->data;
     return LK_OK;
@@ -1473,12 +3729,89 @@ LK_API int lk_wait (lk_State *S, lk_Signal* sig, int waitms) {
 LK_API lk_Service *lk_self (lk_State *S)
 { lk_Slot *slot = lk_current(S); return slot ? slot->service : NULL; }
 
+LK_API size_t lk_memused (lk_Service *svr) {
+    long used = svr ? lk_atomicload(&svr->memused) : 0;
+    assert(used >= 0);
+    return (size_t)used;
+}
+
+LK_API size_t lk_mempeak (lk_Service *svr)
+{ return svr ? (size_t)lk_atomicload(&svr->mempeak) : 0; }
+
+LK_API size_t lk_exhausted (lk_Service *svr)
+{ return svr ? (size_t)lk_atomicload(&svr->nexhausted) : 0; }
+
+LK_API void lk_setmailbox (lk_Service *svr, unsigned high, unsigned low) {
+    if (svr == NULL) return;
+    lk_lock(svr->lock);
+    svr->mailbox_high = high;
+    svr->mailbox_low  = low < high ? low : high / 2;
+    lk_unlock(svr->lock);
+    if (lk_atomicload(&svr->full)) lkE_drained(svr->slot.S, svr);
+}
+
+LK_API int lk_setpriority (lk_Service *svr, int priority) {
+    lk_State *S;
+    if (svr == NULL || priority < 0 || priority >= LK_PRIORITIES)
+        return LK_ERR;
+    S = svr->slot.S;
+    lk_lock(svr->lock);
+    (void)lk_atomicdec(&S->npriority[svr->priority]);
+    (void)lk_atomicinc(&S->npriority[priority]);
+    svr->priority = priority; /* used from the next activation */
+    lk_unlock(svr->lock);
+    return LK_OK;
+}
+
+LK_API int lk_setcoroutine (lk_Service *svr, int enable) {
+#ifdef LK_NO_COROUTINE
+    (void)enable;
+    return svr != NULL && !enable ? LK_OK : LK_ERR;
+#else
+    if (svr == NULL) return LK_ERR;
+    svr->coroutine = enable != 0; /* suspended ones still get responses */
+    return LK_OK;
+#endif
+}
+
+LK_API size_t lk_waitstats (lk_State *S, int priority, size_t *avg_ns, size_t *max_ns) {
+    unsigned long count = 0;
+    lk_Nanotime total = 0, maxwait = 0;
+    int i;
+    if (S == NULL || priority < 0 || priority >= LK_PRIORITIES)
+        return 0;
+    lk_lock(S->lock);
+    for (i = 0; i < S->nworkers; ++i) {
+        lk_Worker *w = &S->workers[i];
+        count += w->nwaits[priority];
+        total += w->waittime[priority];
+        if (w->maxwait[priority] > maxwait) maxwait = w->maxwait[priority];
+    }
+    lk_unlock(S->lock);
+    if (avg_ns) *avg_ns = count ? (size_t)(total / count) : 0;
+    if (max_ns) *max_ns = (size_t)maxwait;
+    return (size_t)count;
+}
+
+LK_API void lk_setquota (lk_Service *svr, size_t quota, lk_QuotaHandler *h, void *ud) {
+    if (svr == NULL) return;
+    lk_lock(svr->lock);
+    svr->quotaf   = h;
+    svr->quota_ud = ud;
+    svr->memquota = quota > (size_t)LONG_MAX ? LONG_MAX : (long)quota;
+    lk_unlock(svr->lock);
+}
+
 static int lkS_initsevice (lk_State *S, lk_Service *svr) {
     lkP_setsvr(svr);
-    lkP_setactive(svr);
+    svr->scheduled = 1; /* until initialized */
     svr->slot.service = svr;
     svr->slots = &svr->slot;
-    lkQ_init(&svr->signals);
+    svr->priority = LK_PRIORITY_NORMAL;
+    (void)lk_atomicinc(&S->npriority[LK_PRIORITY_NORMAL]);
+    lkQ_init(&svr->backlog);
+    lkB_init(&svr->mailbox);
+    lkB_init(&svr->express);
     if (!lk_initlock(&svr->lock)) {
         if (svr != &S->root) {
             lk_lock(S->pool_lock);
@@ -1503,6 +3836,11 @@ static void lkS_freepolls (lk_State *S, lk_Service *svr) {
 
 static void lkS_freeslotsG (lk_State *S, lk_Service *svr) {
     lk_Slot **pslots, *slot;
+    for (slot = svr->slots; slot != NULL; slot = slot->next)
+        if (slot->source != NULL) { /* a callback that no emit took */
+            lk_freesource(slot->source);
+            slot->source = NULL;
+        }
     lk_lock(S->lock);
     for (slot = svr->slots; slot != NULL; slot = slot->next) {
         lk_Entry *e = lk_gettable(&S->slot_names, slot->name);
@@ -1512,10 +3850,13 @@ static void lkS_freeslotsG (lk_State *S, lk_Service *svr) {
     lk_unlock(S->lock);
     lk_lock(S->pool_lock);
     for (pslots = &svr->slots; *pslots != NULL;) {
-        if (lkP_issvr(slot = *pslots) || lkP_ispoll(slot))
+        if (lkP_issvr(slot = *pslots) || lkP_ispoll(slot)) {
+            lkE_freeconflate(S, slot);
             pslots = &slot->next;
+        }
         else {
             *pslots = slot->next;
+            lkE_freeconflate(S, slot);
             lk_poolfree(&S->slots, slot);
         }
     }
@@ -1524,8 +3865,8 @@ static void lkS_freeslotsG (lk_State *S, lk_Service *svr) {
 
 static void lkS_release (lk_State *S, lk_Service *svr) {
     lk_lock(S->lock);
-    if (!lkP_isweak(svr)) --S->nservices;
-    if (S->nservices == 0) {
+    if (!lkP_isweak(svr)) (void)lk_atomicdec(&S->nservices);
+    if (lk_atomicload(&S->nservices) == 0) {
         lk_lock(S->queue_lock);
         lk_signal(S->queue_event);
         lk_unlock(S->queue_lock);
@@ -1533,6 +3874,13 @@ static void lkS_release (lk_State *S, lk_Service *svr) {
     lk_unlock(S->lock);
 }
 
+static int lkS_hasmail (lk_Service *svr) {
+    return !lkQ_empty(&svr->backlog) || !lkB_empty(&svr->mailbox)
+        || !lkB_empty(&svr->express);
+}
+
+static void lkE_dropcalls (lk_State *S, lk_Service *svr);
+
 static int lkS_delserviceG (lk_State *S, lk_Service *svr) {
     if (svr->slot.handler) {
         lk_Context ctx;
@@ -1542,90 +3890,536 @@ static int lkS_delserviceG (lk_State *S, lk_Service *svr) {
         svr->slot.handler = NULL;
     }
     lkS_freepolls(S, svr);
-    if (svr->pending != 0) return LK_ERR;
+    if (lk_atomicload(&svr->pending) != 0) return LK_ERR;
+    if (svr->ncalls != 0) lkE_dropcalls(S, svr);
+    if (svr->nsuspended != 0) lkR_dropall(S, svr);
     lkS_freeslotsG(S, svr);
     lkS_release(S, svr);
+    (void)lk_atomicdec(&S->npriority[svr->priority]);
     lk_freelock(svr->lock);
-    assert(lkQ_empty(&svr->signals));
+    assert(!lkS_hasmail(svr) && svr->waiters == NULL);
+    lkE_notifyrefused(S, svr, svr->refused, svr->nrefused, svr->refused_size);
     if (svr != &S->root) {
-        lk_lock(S->pool_lock);
-        lk_poolfree(&S->services, svr);
-        lk_unlock(S->pool_lock);
+        /* its blocks may outlive it: then the last one freed frees it */
+        (void)lk_atomicxchg(&svr->orphan, 1);
+        if (lk_atomicadd(&svr->memused, 0) == 0) lkM_freeorphan(svr);
     }
     return LK_OK;
 }
 
-static void lkS_active (lk_State *S, lk_Service *svr) {
-    if (!lkP_isactive(svr)) {
-        lkP_setactive(svr);
+static int lkS_canage (lk_State *S, int priority) {
+    int i;
+    if (S->aging_ns == 0) return 0;
+    for (i = 0; i < priority; ++i)
+        if (lk_atomicload(&S->npriority[i]) != 0) return 1;
+    return 0;
+}
+
+static void lkS_schedule (lk_State *S, lk_Service *svr, int wakeup) {
+    lk_Worker *w = S->steal ? (lk_Worker*)lk_gettls(S->worker_index) : NULL;
+    /* read the clock only for stats, or to age past a higher class */
+    svr->queued = S->waitstats || lkS_canage(S, svr->priority) ?
+        lkT_nanoclock() : 0;
+    if (w == NULL) {
+        lk_lock(S->queue_lock);
+        lkQ_enqueue(&S->main_queue.q[svr->priority], svr);
+        (void)lk_atomicinc(&S->main_queue.count);
+        if (lk_atomicload(&S->nidle) != 0) lk_signal(S->queue_event);
+        lk_unlock(S->queue_lock);
+        return;
+    }
+    /* bulk services never jump the queue */
+    if (wakeup && S->runnext && svr->priority <= LK_PRIORITY_NORMAL) {
+        /* a service woken by this worker runs here next, while the data
+         * it was sent is still warm; the one it displaces is queued */
+        svr = (lk_Service*)lk_atomicxchgp(&w->runnext, svr);
+        if (svr == NULL) return;
+    }
+    lk_lock(w->lock);
+    lkQ_enqueue(&w->queue.q[svr->priority], svr);
+    (void)lk_atomicinc(&w->queue.count); /* a barrier before nidle */
+    lk_unlock(w->lock);
+    /* do not take queue_lock unless someone is asleep, and leave it to
+     * a spinning worker if there is one; lkG_park checks count after it
+     * counts itself in nidle, so one of us sees the other */
+    if (lk_atomicload(&S->nidle) != 0 && lk_atomicload(&S->nspinning) == 0) {
         lk_lock(S->queue_lock);
-        lkQ_enqueue(&S->main_queue, svr);
         lk_signal(S->queue_event);
         lk_unlock(S->queue_lock);
     }
 }
 
-static void lkS_callslot (lk_State *S, lk_SignalNode *node, lk_Context *ctx) {
-    lk_Slot   *sender = node->sender;
+static void lkS_active (lk_State *S, lk_Service *svr) {
+    if (lk_atomicxchg(&svr->scheduled, 1) == 0)
+        lkS_schedule(S, svr, 1);
+}
+
+static void lkS_deactive (lk_State *S, lk_Service *svr) {
+    if (lkS_hasmail(svr)) {
+        lkS_schedule(S, svr, 0);
+        return;
+    }
+    (void)lk_atomicxchg(&svr->scheduled, 0);
+    /* a sender may have pushed after the check but still seen us
+     * scheduled; head only leaves the stub by a push */
+    if ((lk_atomicloadp(&svr->mailbox.head) != &svr->mailbox.stub
+                || lk_atomicloadp(&svr->express.head) != &svr->express.stub)
+            && lk_atomicxchg(&svr->scheduled, 1) == 0)
+        lkS_schedule(S, svr, 0);
+}
+
+static int lkS_prepare (lk_State *S, lk_Slot *slot, lk_SignalNode *node, unsigned *now) {
+    if (slot->conflate != NULL) lkE_unconflate(slot, node);
+    return lkE_checkttl(S, node, now);
+}
+
+static int lkE_callreply (lk_State *S, lk_Slot *sender, lk_Signal *sig, lk_Context *ctx);
+
+/* responses go through the refactor of the slot that sent them first */
+static int lkS_refactor (lk_State *S, lk_SignalNode *node, lk_Signal *sig, lk_Context *ctx) {
+    lk_Slot *sender = node->sender;
+    lk_Handler *const refactor = sender->refactor ?
+        sender->refactor : sender->service->slot.refactor;
+    int ret = LK_ERR;
+    ctx->current = node->recipient;
+    if (refactor != NULL)
+        lk_try(S, ctx, ret = refactor(S, sender, sig));
+    return ret;
+}
+
+static void lkS_invoke (lk_State *S, lk_SignalNode *node, lk_Signal *sig, lk_Context *ctx) {
     lk_Slot   *slot   = node->recipient;
+    lk_Slot   *sender = node->sender;
     lk_Source *src    = node->data.source;
+    lk_BatchSignal one;
     int ret = LK_ERR, isack = node->data.isack;
     ctx->current  = slot;
     slot->current = node;
-    if (isack) {
-        lk_Handler *const refactor = sender->refactor ?
-            sender->refactor : sender->service->slot.refactor;
-        if (refactor != NULL)
-            lk_try(S, ctx, ret = refactor(S, sender, &node->data));
-    }
+    if (isack) ret = lkS_refactor(S, node, sig, ctx);
+    /* a call ends with its reply, whatever the refactor returned */
+    if (isack && lkE_iscall(src) && src->service == slot->service)
+        ret = lkE_callreply(S, sender, sig, ctx);
     if (ret == LK_ERR && src && src->callback
             && (isack || src->force) && src->service == slot->service)
-        lk_try(S, ctx, ret = src->callback(S, sender, &node->data));
+        lk_try(S, ctx, ret = src->callback(S, sender, sig));
     if (ret == LK_ERR && slot->handler != NULL)
-        lk_try(S, ctx, slot->handler(S, sender, &node->data));
+        lk_try(S, ctx, slot->handler(S, sender, sig));
+    else if (ret == LK_ERR && slot->batchf != NULL) {
+        one.sender = sender;
+        one.data   = *sig;
+        lk_try(S, ctx, slot->batchf(S, &one, 1));
+    }
     slot->current = NULL;
-    lkP_callhook(slot, node->sender, &node->data);
+}
+
+static void lkS_finish (lk_State *S, lk_SignalNode *node) {
+    lkP_callhook(node->recipient, node->sender, &node->data);
     lkE_delsignal(S, node);
 }
 
+/* coroutines of a service only run inside its dispatch, one at a time */
+
+#define lkR_iswakeup(node) ((node)->sender == NULL)
+
+static void lkR_run (lk_Coroutine *co) {
+    lk_State *S = co->S;
+    lk_SignalNode *node = co->node;
+    lk_pushcontext(S, &co->ctx, &node->recipient->service->slot);
+    co->sig = node->data; /* outlives the node, which lk_wait ends */
+    lkS_invoke(S, node, &co->sig, &co->ctx);
+    if (co->node != NULL) lkS_finish(S, co->node);
+    co->node = NULL;
+    lk_popcontext(S, &co->ctx);
+    if (co->arena.chunks != NULL) lkM_resetarena(S, &co->arena, 1);
+}
+
+static void lkR_resume (lk_State *S, lk_Coroutine *co) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    lk_Context *ctx = lk_context(S);
+    if (co->state == LKR_SUSPENDED) { /* lk_wait returns on this worker */
+        co->ctx.prev = ctx;
+        lk_settls(S->tls_index, &co->ctx);
+    }
+    co->state = LKR_RUNNING;
+    cache->running = co;
+    lkR_switchin(cache, co);
+    cache->running = NULL;
+    lk_settls(S->tls_index, ctx);
+    /* a timeout still queued keeps it until lkR_wakeup has seen it */
+    if (co->state == LKR_IDLE && lk_atomicload(&co->nwakeups) == 0)
+        lkR_put(S, cache, co);
+}
+
+static int lkR_start (lk_State *S, lk_SignalNode *node) {
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    lk_Coroutine *co;
+    if (cache == NULL || (co = lkR_get(S, cache)) == NULL)
+        return 0;
+    co->node = node;
+    lkR_resume(S, co);
+    return 1;
+}
+
+static void lkR_wake (lk_State *S, lk_Coroutine *co, lk_SignalNode *node, int ret) {
+    lk_Service *svr = co->ctx.current->service;
+    lkR_unlink(co);
+    --svr->nsuspended;
+    if (co->timed) (void)lkT_stoptimer(S, &co->timer);
+    co->timed = 0;
+    co->node  = node;
+    co->ret   = ret;
+    lkR_resume(S, co);
+}
+
+static void lkR_ontimer (lk_State *S, lk_Timer *t) {
+    lk_Coroutine *co = (lk_Coroutine*)((char*)t - offsetof(lk_Coroutine, timer));
+    lk_Slot *slot = co->ctx.current;
+    lk_Service *svr = slot->service;
+    lk_SignalNode *node = (lk_SignalNode*)lkM_alloc(S, signals);
+    lk_Signal sig = LK_SIGNAL;
+    /* a signal without sender, which lkR_wakeup matches to the wait */
+    sig.data = co;
+    sig.type = co->seq & LK_TYPE_MASK;
+    node->sender    = NULL;
+    node->recipient = slot;
+    node->data      = sig;
+    (void)lk_atomicinc(&co->nwakeups);
+    (void)lk_atomicinc(&svr->nqueued);
+    lkB_push(&svr->express, node, node);
+    lkS_active(S, svr);
+}
+
+static void lkR_wakeup (lk_State *S, lk_SignalNode *node) {
+    lk_Coroutine *co = (lk_Coroutine*)node->data.data;
+    int current = (co->seq & LK_TYPE_MASK) == node->data.type;
+    long nwakeups = lk_atomicdec(&co->nwakeups);
+    lkM_free(S, signals, node);
+    if (co->state == LKR_SUSPENDED && current)
+        lkR_wake(S, co, NULL, LK_TIMEOUT);
+    else if (co->state == LKR_IDLE && nwakeups == 0)
+        lkR_put(S, (lk_Cache*)lk_gettls(S->cache_index), co);
+}
+
+static int lkR_wait (lk_State *S, lk_Coroutine *co, lk_Signal *sig, int waitms) {
+    lk_Slot *slot = co->ctx.current;
+    lk_Service *svr = slot->service;
+    if (co->node != NULL) { /* the signal handled so far is done */
+        lkS_finish(S, co->node);
+        co->node = NULL;
+    }
+    if (lkP_isdead(svr)) return LK_ERR;
+    if (waitms == 0) return LK_TIMEOUT;
+    ++co->seq;
+    co->timer.h = lkR_ontimer;
+    if (waitms > 0 && lkT_starttimer(S, &co->timer, (unsigned)waitms) != LK_OK)
+        return LK_ERR;
+    co->timed = waitms > 0;
+    lkR_link(sig != NULL ? &slot->waiting : &svr->sleeping, co);
+    ++svr->nsuspended;
+    co->state = LKR_SUSPENDED;
+    lkR_switchout(co);
+    if (co->ret == LK_OK && sig != NULL) *sig = co->node->data;
+    return co->ret;
+}
+
+static void lkR_wakeall (lk_State *S, lk_Service *svr) {
+    lk_Slot *slot;
+    for (slot = svr->slots; slot != NULL; slot = slot->next)
+        while (slot->waiting != NULL)
+            lkR_wake(S, slot->waiting, NULL, LK_ERR);
+    while (svr->sleeping != NULL)
+        lkR_wake(S, svr->sleeping, NULL, LK_ERR);
+}
+
+/* call routines: the pending calls of a service only change inside its
+ * dispatch; timeouts come from the timer heap as signals without sender */
+
+static void lkE_endcall (lk_State *S, lk_Call *call) {
+    lk_Service *svr = call->src.service;
+    call->pending = 0;
+    if (call->timed) (void)lkT_stoptimer(S, &call->timer);
+    call->timed = 0;
+    if ((*call->pprev = call->next) != NULL)
+        call->next->pprev = call->pprev;
+    --svr->ncalls;
+}
+
+static void lkE_failcall (lk_State *S, lk_Call *call, int ret, lk_Context *ctx) {
+    lk_Signal sig = LK_SIGNAL;
+    lkE_endcall(S, call);
+    if (call->co != NULL)
+        lkR_wake(S, call->co, NULL, ret);
+    else {
+        sig.source = &call->src;
+        ctx->current = call->slot;
+        lk_try(S, ctx, call->h(S, NULL, &sig));
+    }
+    lk_freesource(&call->src); /* the reference of the pending call */
+}
+
+static int lkE_callreply (lk_State *S, lk_Slot *sender, lk_Signal *sig, lk_Context *ctx) {
+    lk_Call *call = (lk_Call*)sig->source;
+    if (call->pending && call->h != NULL) { /* a late reply is dropped */
+        lkE_endcall(S, call);
+        ctx->current = call->slot;
+        lk_try(S, ctx, call->h(S, sender, sig));
+        lk_freesource(&call->src);
+    }
+    return LK_OK;
+}
+
+static lk_Coroutine *lkE_callwaiter (lk_State *S, lk_SignalNode *node) {
+    lk_Call *call = (lk_Call*)node->data.source;
+    lk_Coroutine *co = call->co;
+    if (co == NULL || !call->pending
+            || call->src.service != node->recipient->service)
+        return NULL;
+    lkE_endcall(S, call);
+    lk_freesource(&call->src); /* the reply node still holds it */
+    return co;
+}
+
+static void lkE_ontimeout (lk_State *S, lk_Timer *t) {
+    lk_Call *call = (lk_Call*)((char*)t - offsetof(lk_Call, timer));
+    lk_Service *svr = call->src.service;
+    lk_SignalNode *node = (lk_SignalNode*)lkM_alloc(S, signals);
+    lk_Signal sig = LK_SIGNAL;
+    sig.source = &call->src; /* keeps the call until it is handled */
+    lk_usesource(&call->src);
+    node->sender    = NULL;
+    node->recipient = call->slot;
+    node->data      = sig;
+    (void)lk_atomicinc(&svr->nqueued);
+    lkB_push(&svr->express, node, node);
+    lkS_active(S, svr);
+}
+
+static void lkE_calltimeout (lk_State *S, lk_SignalNode *node, lk_Context *ctx) {
+    lk_Call *call = (lk_Call*)node->data.source;
+    lkM_free(S, signals, node);
+    if (call->pending) lkE_failcall(S, call, LK_TIMEOUT, ctx);
+    lk_freesource(&call->src);
+}
+
+static void lkE_failcalls (lk_State *S, lk_Service *svr, lk_Context *ctx) {
+    while (svr->calls != NULL)
+        lkE_failcall(S, svr->calls, LK_ERR, ctx);
+}
+
+static void lkE_dropcalls (lk_State *S, lk_Service *svr) {
+    lk_Call *call;
+    while ((call = svr->calls) != NULL) {
+        lkE_endcall(S, call);
+        lk_freesource(&call->src);
+    }
+}
+
+LK_API int lk_call (lk_Slot *slot, lk_Signal *sig, int timeout_ms, lk_Handler *h, void *ud) {
+    lk_State *S = slot ? slot->S : NULL;
+    lk_Slot *current = S ? lk_current(S) : NULL;
+    lk_Coroutine *co = NULL;
+    lk_Service *svr;
+    lk_Call *call;
+    lk_Signal req;
+    int ret;
+    if (current == NULL || sig == NULL || lkP_ispoll(current))
+        return LK_ERR; /* only a service handler owns the pending calls */
+    svr = current->service;
+    if (h == NULL) {
+        lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+        if (cache == NULL || (co = cache->running) == NULL)
+            return LK_ERR;
+        if (lkP_isdead(svr)) return LK_ERR;
+    }
+    call = (lk_Call*)lkM_alloc(S, calls);
+    lk_initsource(S, &call->src, NULL, ud);
+    call->src.deletor  = lkE_calldeletor;
+    call->src.refcount = 1; /* released when the call ends */
+    call->timer.h     = lkE_ontimeout;
+    call->timer.index = 0;
+    call->slot    = current;
+    call->h       = h;
+    call->co      = co;
+    call->pending = 1;
+    call->timed   = 0;
+    if ((call->next = svr->calls) != NULL)
+        call->next->pprev = &call->next;
+    call->pprev = &svr->calls;
+    svr->calls = call;
+    ++svr->ncalls;
+    req = *sig;
+    req.source = &call->src;
+    req.isack  = 0;
+    if ((ret = lk_emit(slot, &req)) != LK_OK) {
+        lkE_endcall(S, call);
+        lk_freesource(&call->src);
+        return ret;
+    }
+    if (timeout_ms > 0)
+        call->timed = lkT_starttimer(S, &call->timer,
+                (unsigned)timeout_ms) == LK_OK;
+    if (co == NULL) return LK_OK;
+    if (co->node != NULL) { /* the signal handled so far is done */
+        lkS_finish(S, co->node);
+        co->node = NULL;
+    }
+    co->timed = 0;
+    lkR_link(&svr->sleeping, co);
+    ++svr->nsuspended;
+    co->state = LKR_SUSPENDED;
+    lkR_switchout(co);
+    if (co->ret == LK_OK) *sig = co->node->data;
+    return co->ret;
+}
+
+static void lkS_callslot (lk_State *S, lk_SignalNode *node, lk_Context *ctx, unsigned *now) {
+    lk_Slot *slot = node->recipient;
+    lk_Coroutine *co;
+    if (lkR_iswakeup(node)) {
+        if (node->data.source != NULL) lkE_calltimeout(S, node, ctx);
+        else lkR_wakeup(S, node);
+        return;
+    }
+    if (!lkS_prepare(S, slot, node, now)) return;
+    if (node->data.isack && lkE_iscall(node->data.source)
+            && (co = lkE_callwaiter(S, node)) != NULL) {
+        (void)lkS_refactor(S, node, &node->data, ctx);
+        lkR_wake(S, co, node, LK_OK);
+    }
+    else if (node->data.isack && slot->waiting != NULL
+            && !lkE_iscall(node->data.source))
+        lkR_wake(S, slot->waiting, node, LK_OK);
+    else if (!slot->service->coroutine || !lkR_start(S, node)) {
+        lkS_invoke(S, node, &node->data, ctx);
+        lkS_finish(S, node);
+    }
+}
+
+#define lkS_batchable(node) (!(node)->data.isack && (node)->data.source == NULL)
+
+/* returns the signals after the batch; those it left go first, and *kept
+ * is the last of them */
+static lk_SignalNode *lkS_callbatch (lk_State *S, lk_SignalNode *node, lk_Context *ctx, unsigned *now, lk_SignalNode **kept) {
+    lk_Slot *slot = node->recipient;
+    lk_SignalNode *rest, *next, **nodes;
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    lk_BatchSignal *sigs;
+    int i, n = 0, count = 0, ret = LK_OK;
+    for (rest = node; rest != NULL && count < LK_BATCH_MAX
+            && rest->recipient == slot && lkS_batchable(rest); rest = rest->next)
+        ++count;
+    /* the buffer is reused by every batch this thread runs */
+    if (cache != NULL && cache->batch == NULL)
+        cache->batch = (lk_BatchSignal*)S->allocf(S->alloc_ud,
+                NULL, LK_BATCH_BYTES, 0);
+    if (cache != NULL && cache->batch != NULL)
+        sigs = cache->batch;
+    else
+        sigs = (lk_BatchSignal*)lk_malloc(S, LK_BATCH_BYTES);
+    nodes = (lk_SignalNode**)(sigs + LK_BATCH_MAX);
+    for (; node != rest; node = next) {
+        next = node->next;
+        if (!lkS_prepare(S, slot, node, now)) continue;
+        sigs[n].sender = node->sender;
+        sigs[n].data   = node->data;
+        nodes[n++] = node;
+    }
+    if (n != 0) {
+        ctx->current = slot;
+        lk_try(S, ctx, ret = slot->batchf(S, sigs, n));
+        if (ret <= 0 || ret > n) ret = n; /* LK_OK or errors: all done */
+        if (slot->hookf != NULL)
+            for (i = 0; i < ret; ++i)
+                lkP_callhook(slot, nodes[i]->sender, &nodes[i]->data);
+        lkE_delsignals(S, nodes, ret);
+    }
+    if (ret < n) { /* relink the rest, expired nodes are gone */
+        for (i = ret; i < n-1; ++i)
+            nodes[i]->next = nodes[i+1];
+        nodes[n-1]->next = rest;
+        *kept = nodes[n-1];
+        rest = nodes[ret];
+    }
+    if (cache == NULL || sigs != cache->batch)
+        lk_free(S, sigs, LK_BATCH_BYTES);
+    return rest;
+}
+
 static void lkS_callslotsS (lk_State *S, lk_Service *svr) {
+    lk_Cache *cache;
     lk_Context ctx;
+    lkQ_type(lk_SignalNode) signals;
     lk_SignalNode *node;
+    lk_Nanotime start = 0;
+    unsigned count = 0, nexpress = 0, now = 0;
+    int exhausted = 0;
+
+    /* fetch signals left from the last dispatch, or up to the budget */
+    lkQ_init(&signals);
+    if (!lkQ_empty(&svr->backlog)) {
+        lkQ_merge(&signals, &svr->backlog);
+        lkQ_init(&svr->backlog);
+    }
+    else {
+        while ((svr->budget == 0 || count < svr->budget)
+                && (node = lkB_pop(&svr->mailbox)) != NULL)
+            lkQ_enqueue(&signals, node), ++count;
+        exhausted = svr->budget != 0 && count == svr->budget
+            && !lkB_empty(&svr->mailbox);
+    }
+    node = signals.first;
 
-    /* fetch all signal */
-    lk_lock(svr->lock);
-    lkQ_clear(&svr->signals, node);
-    lk_unlock(svr->lock);
-
-    /* call signal handler */
+    /* call signal handler, emits may be buffered until the batch ends */
     lk_pushcontext(S, &ctx, &svr->slot);
-    while (node != NULL) {
-        lk_SignalNode *next = node->next;
-        lkS_callslot(S, node, &ctx);
+    cache = S->outbox ? (lk_Cache*)lk_gettls(S->cache_index) : NULL;
+    if (cache != NULL) cache->buffering = 1;
+    if (svr->budget_ns != 0) start = lkT_nanoclock();
+    for (;;) {
+        lk_SignalNode *next, *kept = NULL;
+        /* urgent signals overtake whatever is left of the batch */
+        while ((next = lkB_pop(&svr->express)) != NULL)
+            lkS_callslot(S, next, &ctx, &now), ++nexpress;
+        if (node == NULL) break;
+        if (node->recipient->batchf != NULL && lkS_batchable(node))
+            next = lkS_callbatch(S, node, &ctx, &now, &kept);
+        else {
+            next = node->next;
+            lkS_callslot(S, node, &ctx, &now);
+        }
         node = next;
+        if (node != NULL && (kept != NULL || (svr->budget_ns != 0
+                        && lkT_nanoclock() - start >= svr->budget_ns))) {
+            /* out of time, or a batch left some: the rest runs first on
+             * the next dispatch */
+            svr->backlog.first = node;
+            svr->backlog.plast = kept != NULL && kept->next == NULL ?
+                &kept->next : signals.plast;
+            exhausted = 1;
+            break;
+        }
+    }
+    if (svr->ncalls != 0 && lkP_isdead(svr)) lkE_failcalls(S, svr, &ctx);
+    if (svr->nsuspended != 0 && lkP_isdead(svr)) lkR_wakeall(S, svr);
+    if (exhausted) lk_atomicinc(&svr->nexhausted);
+    if (cache != NULL) {
+        if (cache->noutbox != 0) lkE_flushoutbox(S, cache);
+        cache->buffering = 0;
     }
+    if (count + nexpress != 0)
+        (void)lk_atomicadd(&svr->nqueued, -(long)(count + nexpress));
+    if (lk_atomicload(&svr->full)) lkE_drained(S, svr);
     lk_popcontext(S, &ctx);
+    lkM_endbatch(S);
 }
 
 static void lkS_dispatchGS (lk_State *S, lk_Service *svr) {
-    int should_delete = 0;
-    assert(lkP_isactive(svr));
+    assert(lk_atomicload(&svr->scheduled));
     lkS_callslotsS(S, svr);
-
-    lk_lock(svr->lock);
-    if (!lkQ_empty(&svr->signals)) {
-        lk_lock(S->queue_lock);
-        lkQ_enqueue(&S->main_queue, svr);
-        lk_unlock(S->queue_lock);
-    }
-    else if (lkP_isdead(svr) && svr->pending == 0)
-        should_delete = 1;
-    else
-        lkP_clractive(svr);
-    lk_unlock(svr->lock);
-
-    if (should_delete && lkS_delserviceG(S, svr) != LK_OK)
-        lkP_clractive(svr);
+    if (!lkS_hasmail(svr) && lkP_isdead(svr)
+            && lk_atomicload(&svr->pending) == 0
+            && lkS_delserviceG(S, svr) == LK_OK)
+        return;
+    lkS_deactive(S, svr);
 }
 
 static int lkS_check (lk_State *S, const char *name, lk_Handler *h) {
@@ -1635,7 +4429,7 @@ static int lkS_check (lk_State *S, const char *name, lk_Handler *h) {
         lk_log(S, "E[launch]" lk_loc("serivce name '%s' too long"), name);
         return LK_ERR;
     }
-    return S->nthreads == 0 ? LK_ERR : LK_OK;
+    return lk_atomicload(&S->nthreads) == 0 ? LK_ERR : LK_OK;
 }
 
 static int lkS_callinit (lk_State *S, lk_Service *svr) {
@@ -1652,33 +4446,143 @@ static int lkS_callinit (lk_State *S, lk_Service *svr) {
         return LK_ERR;
     }
     lk_lock(S->lock);
-    ++S->nservices;
+    (void)lk_atomicinc(&S->nservices);
     if (S->logger == NULL && strcmp(svr->slot.name, "log") == 0)
         S->logger = &svr->slot;
     if (ret == LK_WEAK) {
         lkP_setweak(svr);
-        --S->nservices;
+        (void)lk_atomicdec(&S->nservices);
     }
     lk_unlock(S->lock);
     return LK_OK;
 }
 
+static int lkG_configint (lk_State *S, const char *key, int defvalue) {
+    char *value = lk_getconfig(S, key);
+    if (value != NULL) {
+        defvalue = atoi(value);
+        lk_deldata(S, (lk_Data*)value);
+    }
+    return defvalue;
+}
+
+static unsigned lkS_configint (lk_State *S, const char *name, const char *key, int defvalue) {
+    char buff[64 + LK_MAX_NAMESIZE];
+    int value = lkG_configint(S, key, defvalue);
+    sprintf(buff, "%s.%s", key, name);
+    value = lkG_configint(S, buff, value);
+    return value > 0 ? (unsigned)value : 0;
+}
+
 static lk_Service *lkS_callinitGS (lk_State *S, lk_Service *svr, lk_Handler *h, void *ud) {
     lk_Signal sig = LK_RESPONSE;
+    unsigned high;
+    svr->budget    = lkS_configint(S, svr->slot.name, "loki.budget.signals", 0);
+    svr->budget_ns = lkS_configint(S, svr->slot.name, "loki.budget.ns", 0);
+    high = lkS_configint(S, svr->slot.name, "loki.mailbox.high", 0);
+    lk_setmailbox(svr, high, lkS_configint(S, svr->slot.name,
+                "loki.mailbox.low", (int)(high/2)));
+    lk_setcoroutine(svr, (int)lkS_configint(S, svr->slot.name,
+                "loki.coroutine", 0));
+    lk_setpriority(svr, (int)lkS_configint(S, svr->slot.name,
+                "loki.priority", LK_PRIORITY_NORMAL));
     svr->slot.handler  = h;
     svr->slot.userdata = ud;
     if (h && lkS_callinit(S, svr) != LK_OK)
         return NULL;
     sig.data = svr;
     lk_broadcast(S, LK_SLOTNAME_LAUNCH, &sig);
-    lk_lock(svr->lock);
-    lkP_clractive(svr);
-    if (!lkQ_empty(&svr->signals))
-        lkS_active(S, svr);
-    lk_unlock(svr->lock);
+    lkS_deactive(S, svr);
     return svr;
 }
 
+#define LK_STATEPOOLS (7 + LK_SIZECLASSES)
+
+static size_t lkM_statepools (lk_State *S, lk_MemPool **pools) {
+    size_t i, npools = 0;
+    pools[npools++] = &S->services;
+    pools[npools++] = &S->slots;
+    pools[npools++] = &S->polls;
+    pools[npools++] = &S->defers;
+    pools[npools++] = &S->signals;
+    pools[npools++] = &S->sources;
+    for (i = 0; i < LK_SIZECLASSES; ++i)
+        pools[npools++] = &S->smallpieces[i];
+    pools[npools++] = &S->calls; /* no LK_RESERVE_ kind */
+    return npools;
+}
+
+static size_t lkM_trimall (lk_State *S, int high, int low) {
+    lk_MemPool *pools[LK_STATEPOOLS];
+    lk_Cache *cache = (lk_Cache*)lk_gettls(S->cache_index);
+    size_t i, npools = lkM_statepools(S, pools), total = 0;
+    if (cache != NULL) {
+        lk_lock(S->pool_lock);
+        lkM_flushcache(S, cache);
+        lk_unlock(S->pool_lock);
+    }
+    for (i = 0; i < npools; ++i) {
+        lk_MemPool *mpool = pools[i];
+        lk_PoolTrim trim;
+        size_t live, keep = 0;
+        lk_lock(S->pool_lock);
+        live = mpool->nobjs - mpool->nfree;
+        if (high >= 0) keep = live*(size_t)low/100;
+        if (keep < mpool->reserve) keep = mpool->reserve;
+        if (mpool->npages == 0 || mpool->nfree <= keep
+                || (high >= 0 && mpool->nfree <= live*(size_t)high/100)) {
+            lk_unlock(S->pool_lock);
+            continue;
+        }
+        /* sort outside the lock: workers refilling their caches from the
+         * pool meanwhile just get new pages */
+        lkM_detachpool(mpool, &trim);
+        lk_unlock(S->pool_lock);
+        total += lkM_trimpages(S, mpool, &trim, keep);
+        lk_lock(S->pool_lock);
+        lkM_splicepool(mpool, &trim);
+        lk_unlock(S->pool_lock);
+    }
+    return total;
+}
+
+LK_API size_t lk_trimpools (lk_State *S)
+{ return S ? lkM_trimall(S, -1, 0) : 0; }
+
+LK_API int lk_reserve (lk_State *S, int kind, size_t count) {
+    lk_MemPool *pools[LK_STATEPOOLS], *mpool;
+    if (S == NULL || kind < 0) return LK_ERR;
+    (void)lkM_statepools(S, pools);
+    if (kind < LK_RESERVE_PIECES)
+        mpool = pools[kind];
+    else if (lkM_issmall((size_t)(kind - LK_RESERVE_PIECES)))
+        mpool = &S->smallpieces[lkM_blockclass(kind - LK_RESERVE_PIECES)];
+    else
+        return LK_ERR;
+    lk_lock(S->pool_lock);
+    lk_poolreserve(S, mpool, count);
+    lk_unlock(S->pool_lock);
+    return LK_OK;
+}
+
+LK_API int lk_setpagesize (lk_State *S, size_t pagesize, unsigned flags) {
+    lk_MemPool *pools[LK_STATEPOOLS];
+    size_t i, npools;
+    int ret = LK_OK;
+    if (S == NULL) return LK_ERR;
+    npools = lkM_statepools(S, pools);
+    lk_lock(S->pool_lock);
+    for (i = 3; i < npools; ++i) { /* services, slots and polls are cold */
+        lk_MemPool *mpool = pools[i];
+        size_t size = lkM_defpagesize(mpool->size);
+        if (size < pagesize) size = pagesize;
+        if (lk_setpoolpage(mpool, size, flags) != LK_OK)
+            ret = LK_ERR;
+    }
+    lk_unlock(S->pool_lock);
+    return ret;
+}
+
 LK_API lk_Service *lk_launch (lk_State *S, const char *name, lk_Handler *h, void *data) {
     lk_Service *svr;
     if (lkS_check(S, name, h) != LK_OK) return NULL;
@@ -1697,46 +4601,188 @@ LK_API lk_Service *lk_launch (lk_State *S, const char *name, lk_Handler *h, void
 }
 
 LK_API int lk_retain (lk_Service *svr) {
-    int pending;
     if (svr == NULL) return 0;
-    lk_lock(svr->lock);
-    pending = (int)++svr->pending;
-    lk_unlock(svr->lock);
-    return pending;
+    return (int)lk_atomicinc(&svr->pending);
 }
 
 LK_API int lk_release (lk_Service *svr) {
-    int pending = 0;
+    long pending;
     if (svr == NULL) return 0;
-    lk_lock(svr->lock);
-    if (svr->pending > 0) pending = (int)--svr->pending;
+    pending = lk_atomicdec(&svr->pending);
+    assert(pending >= 0);
     if (pending == 0 && lkP_isdead(svr)) lkS_active(svr->slot.S, svr);
-    lk_unlock(svr->lock);
-    return pending;
+    return (int)pending;
 }
 
 
 /* global routines */
 
-static void lkG_worker(void *ud) {
-    lk_State *S = (lk_State*)ud;
+#define lkG_emptyqueue(rq) (lk_atomicload(&(rq)->count) == 0)
+
+static lk_Service *lkG_dequeue (lk_State *S, lk_RunQueue *rq) {
+    lk_ServiceQueue *q = rq->q;
+    lk_Service *svr;
+    lk_Nanotime now = 0;
+    int i, pick = -1;
+    for (i = 0; i < LK_PRIORITIES; ++i) {
+        if (lkQ_empty(&q[i])) continue;
+        if (pick < 0) { pick = i; continue; }
+        /* a lower class only overtakes when it has waited too long */
+        if (q[i].first->queued == 0) continue; /* not stamped */
+        if (now == 0) now = lkT_nanoclock();
+        if (now - q[i].first->queued >= S->aging_ns) { pick = i; break; }
+    }
+    if (pick < 0) return NULL;
+    lkQ_dequeue(&q[pick], svr);
+    (void)lk_atomicdec(&rq->count);
+    return svr;
+}
+
+static lk_Service *lkG_popworker (lk_Worker *w) {
+    lk_Service *svr;
+    if (lkG_emptyqueue(&w->queue)) return NULL;
+    lk_lock(w->lock);
+    svr = lkG_dequeue(w->S, &w->queue);
+    lk_unlock(w->lock);
+    return svr;
+}
+
+static lk_Service *lkG_poprunnext (lk_Worker *w) {
+    if (lk_atomicloadp(&w->runnext) == NULL) return NULL;
+    return (lk_Service*)lk_atomicxchgp(&w->runnext, NULL);
+}
+
+static lk_Service *lkG_steal (lk_State *S, lk_Worker *w) {
+    int i, n = S->nworkers;
+    for (i = 1; i < n; ++i) {
+        lk_Worker *victim = &S->workers[(w->index + i) % n];
+        lk_Service *svr = lkG_popworker(victim);
+        if (svr == NULL) svr = lkG_poprunnext(victim);
+        if (svr != NULL) return svr;
+    }
+    return NULL;
+}
+
+static lk_Service *lkG_popglobal (lk_State *S) {
     lk_Service *svr;
+    if (lkG_emptyqueue(&S->main_queue)) return NULL;
     lk_lock(S->queue_lock);
-    while (S->nservices != 0) {
-        lkQ_dequeue(&S->main_queue, svr);
-        while (svr == NULL && S->nservices != 0) {
-            lk_waitevent(&S->queue_event, &S->queue_lock, -1);
-            lkQ_dequeue(&S->main_queue, svr);
-        }
-        while (svr != NULL) {
-            lk_unlock(S->queue_lock);
-            lkS_dispatchGS(S, svr);
-            lk_lock(S->queue_lock);
-            lkQ_dequeue(&S->main_queue, svr);
-        }
+    svr = lkG_dequeue(S, &S->main_queue);
+    lk_unlock(S->queue_lock);
+    return svr;
+}
+
+static void lkG_autotrim (lk_State *S) {
+    unsigned now = lkT_clock();
+    long last = lk_atomicload(&S->lasttrim);
+    if (now - (unsigned)last < (unsigned)S->trim_interval) return;
+    /* only one idle worker does the trimming in each interval */
+    if (lk_atomiccas(&S->lasttrim, last, (long)now))
+        lkM_trimall(S, S->trim_high, S->trim_low);
+}
+
+static int lkG_haswork (lk_State *S, lk_Worker *w);
+
+static int lkG_park (lk_State *S, lk_Worker *w) {
+    int alive;
+    if (S->trim_interval > 0) lkG_autotrim(S);
+    lk_lock(S->queue_lock);
+    alive = lk_atomicload(&S->nservices) != 0;
+    if (alive && lkG_emptyqueue(&S->main_queue)) {
+        /* a barrier, then look again: lkS_schedule and lkT_starttimer
+         * missed us if they read nidle before it */
+        (void)lk_atomicinc(&S->nidle);
+        if (!lkG_haswork(S, w))
+            lk_waitevent(&S->queue_event, &S->queue_lock, lkT_waittime(S,
+                        S->trim_interval > 0 ? S->trim_interval : -1));
+        (void)lk_atomicdec(&S->nidle);
+        alive = lk_atomicload(&S->nservices) != 0;
     }
-    lk_signal(S->queue_event);
+    if (!alive) lk_signal(S->queue_event);
     lk_unlock(S->queue_lock);
+    return alive;
+}
+
+static int lkG_haswork (lk_State *S, lk_Worker *w) {
+    int i;
+    if (!lkG_emptyqueue(&S->main_queue) || !lkG_emptyqueue(&w->queue))
+        return 1;
+    for (i = 0; S->steal && i < S->nworkers; ++i)
+        if (!lkG_emptyqueue(&S->workers[i].queue)
+                || lk_atomicloadp(&S->workers[i].runnext) != NULL)
+            return 1;
+    return 0;
+}
+
+static int lkG_spin (lk_State *S, lk_Worker *w) {
+    lk_Nanotime start;
+    unsigned long limit = w->spin_ns;
+    unsigned i;
+    int found;
+    /* at most half of the workers spin, the others may need the cpus */
+    if (limit == 0 || lk_atomicload(&S->nspinning) * 2 >= S->nworkers)
+        return 0;
+    (void)lk_atomicinc(&S->nspinning);
+    start = lkT_nanoclock();
+    /* closing: lkG_park lets the worker go */
+    for (i = 1; !(found = lkG_haswork(S, w))
+            && lk_atomicload(&S->nservices) != 0; ++i) {
+        lk_cpurelax();
+        if (i % LK_SPIN_CHECK == 0 && lkT_nanoclock() - start >= limit)
+            break;
+    }
+    (void)lk_atomicdec(&S->nspinning);
+    /* spin longer while it pays off, shorter while it does not */
+    if (found)
+        w->spin_ns = limit * 2 < S->spin_ns ? limit * 2 : S->spin_ns;
+    else if (limit / 2 >= S->spin_ns / LK_SPIN_FLOOR)
+        w->spin_ns = limit / 2;
+    return found;
+}
+
+static void lkG_dispatch (lk_Worker *w, lk_Service *svr) {
+    if (w->S->waitstats && svr->queued != 0) {
+        lk_Nanotime wait = lkT_nanoclock() - svr->queued;
+        int prio = svr->priority;
+        ++w->nwaits[prio];
+        w->waittime[prio] += wait;
+        if (wait > w->maxwait[prio]) w->maxwait[prio] = wait;
+    }
+    lkS_dispatchGS(w->S, svr);
+}
+
+static void lkG_worker (void *ud) {
+    lk_Worker *w = (lk_Worker*)ud;
+    lk_State *S = w->S;
+    lk_Cache cache;
+    unsigned tick = 0;
+    lk_settls(S->worker_index, w);
+    lkM_opencache(S, &cache);
+    for (;;) {
+        lk_Service *svr = NULL;
+        /* a chain of runnext handoffs must let the queue run sometimes */
+        if (w->nrunnext < LK_RUNNEXT_LIMIT
+                && (svr = lkG_poprunnext(w)) != NULL) {
+            ++w->nrunnext;
+            lkG_dispatch(w, svr);
+            continue;
+        }
+        w->nrunnext = 0;
+        /* check injections once in a while even if we are busy */
+        if (++tick % LK_GLOBAL_TICK != 0) svr = lkG_popworker(w);
+        else (void)lkT_firetimers(S);
+        if (svr == NULL) svr = lkG_popglobal(S);
+        if (svr == NULL) svr = lkG_popworker(w);
+        if (svr == NULL) svr = lkG_poprunnext(w);
+        if (svr == NULL) svr = lkG_steal(S, w);
+        if (svr != NULL)
+            lkG_dispatch(w, svr);
+        else if (lkT_firetimers(S) == 0 && !lkG_spin(S, w) && !lkG_park(S, w))
+            break;
+    }
+    lkR_closecache(S, &cache);
+    lkM_closecache(S, &cache);
+    lk_settls(S->worker_index, NULL);
 }
 
 static void *default_allocf (void *ud, void *ptr, size_t size, size_t osize) {
@@ -1763,38 +4809,65 @@ static void lkG_clearservices (lk_State *S) {
 }
 
 static int lkG_initstate (lk_State *S, const char *name) {
+    lk_MemPool *pools[LK_STATEPOOLS];
+    size_t npools;
+    int i;
     name = name ? name : LK_NAME;
     if (lkS_initsevice(S, &S->root) != LK_OK)
         return LK_ERR;
     lk_strcpy(S->root.slot.name, name, LK_MAX_NAMESIZE);
     S->root.slot.S = S;
     S->nthreads = -1; /* no thread and no start */
-    lkQ_init(&S->main_queue);
+    for (i = 0; i < LK_PRIORITIES; ++i)
+        lkQ_init(&S->main_queue.q[i]);
+    S->main_queue.count = 0;
     lk_initpool(&S->services, sizeof(lk_Service));
     lk_initpool(&S->slots, sizeof(lk_Slot));
     lk_initpool(&S->polls, sizeof(lk_Poll));
     lk_initpool(&S->defers, sizeof(lk_Defer));
     lk_initpool(&S->signals, sizeof(lk_SignalNode));
     lk_initpool(&S->sources, sizeof(lk_Source));
-    lk_initpool(&S->smallpieces, LK_SMALLPIECE_LEN);
+    lk_initpool(&S->calls, sizeof(lk_Call));
+    for (i = 0; i < LK_SIZECLASSES; ++i)
+        lk_initpool(&S->smallpieces[i], lkM_classsize[i]);
+    npools = lkM_statepools(S, pools);
+    while (npools > 0)
+        pools[--npools]->flags |= LK_POOL_SHARED;
     lk_inittable(&S->config, sizeof(lk_PtrEntry));
     lk_inittable(&S->slot_names, sizeof(lk_Entry));
+    /* made here, the tables of the state are charged to no service */
+    lk_resizetable(S, &S->config, LK_MIN_HASHSIZE);
     lk_settable(S, &S->slot_names, S->root.slot.name);
     return LK_OK;
 }
 
 static void lkG_delstate (lk_State *S) {
+    int i;
     lkG_clearservices(S);
+    lkP_stoppollers(S);
     lk_freepool(S, &S->services);
     lk_freepool(S, &S->slots);
     lk_freepool(S, &S->polls);
     lk_freepool(S, &S->defers);
     lk_freepool(S, &S->signals);
     lk_freepool(S, &S->sources);
-    lk_freepool(S, &S->smallpieces);
+    lk_freepool(S, &S->calls);
+    for (i = 0; i < LK_SIZECLASSES; ++i)
+        lk_freepool(S, &S->smallpieces[i]);
+    lkR_freepool(S);
+    if (S->timers != NULL)
+        S->allocf(S->alloc_ud, S->timers, 0,
+                S->timers_size * sizeof(lk_Timer*));
+    for (i = 0; i < S->nworkers; ++i)
+        lk_freelock(S->workers[i].lock);
     lk_freeevent(S->queue_event);
+    lk_freeevent(S->poller_event);
+    lk_freetls(S->cache_index);
+    lk_freetls(S->worker_index);
     lk_freetls(S->tls_index);
     lk_freelock(S->config_lock);
+    lk_freelock(S->timer_lock);
+    lk_freelock(S->poller_lock);
     lk_freelock(S->queue_lock);
     lk_freelock(S->lock);
     S->allocf(S->alloc_ud, S, 0, sizeof(lk_State));
@@ -1823,7 +4896,7 @@ static void lkG_setconfig(lk_State *S, const char *key, const char *value) {
 }
 
 LK_API lk_State *lk_newstate (const char *name, lk_Allocf *allocf, void *ud) {
-    enum { TLS, EVT, LCK, QLK, CLK, PLK, TOTAL };
+    enum { TLS, WTLS, CTLS, EVT, PEVT, LCK, QLK, TLK, PLLK, CLK, PLK, TOTAL };
     lk_Allocf *alloc = allocf ? allocf : default_allocf;
     lk_State *S = (lk_State*)alloc(ud, NULL, sizeof(lk_State), 0);
     unsigned ok = 0;
@@ -1831,17 +4904,27 @@ LK_API lk_State *lk_newstate (const char *name, lk_Allocf *allocf, void *ud) {
     memset(S, 0, sizeof(*S));
     S->allocf = alloc, S->alloc_ud = ud;
     if (lk_inittls(&S->tls_index))     ok |= 1<<TLS;
+    if (lk_inittls(&S->worker_index))  ok |= 1<<WTLS;
+    if (lk_inittls(&S->cache_index))   ok |= 1<<CTLS;
     if (lk_initevent(&S->queue_event)) ok |= 1<<EVT;
+    if (lk_initevent(&S->poller_event)) ok |= 1<<PEVT;
     if (lk_initlock(&S->lock))         ok |= 1<<LCK;
     if (lk_initlock(&S->queue_lock))   ok |= 1<<QLK;
+    if (lk_initlock(&S->timer_lock))   ok |= 1<<TLK;
+    if (lk_initlock(&S->poller_lock))  ok |= 1<<PLLK;
     if (lk_initlock(&S->config_lock))  ok |= 1<<CLK;
     if (lk_initlock(&S->pool_lock))    ok |= 1<<PLK;
     if (ok == (1<<TOTAL)-1 && lkG_initstate(S, name) == LK_OK) return S;
     if ((ok & (1<<PLK)) != 0) lk_freelock(S->pool_lock);
     if ((ok & (1<<CLK)) != 0) lk_freelock(S->config_lock);
+    if ((ok & (1<<PLLK)) != 0) lk_freelock(S->poller_lock);
+    if ((ok & (1<<TLK)) != 0) lk_freelock(S->timer_lock);
     if ((ok & (1<<QLK)) != 0) lk_freelock(S->queue_lock);
     if ((ok & (1<<LCK)) != 0) lk_freelock(S->lock);
+    if ((ok & (1<<PEVT)) != 0) lk_freeevent(S->poller_event);
     if ((ok & (1<<EVT)) != 0) lk_freeevent(S->queue_event);
+    if ((ok & (1<<CTLS)) != 0) lk_freetls(S->cache_index);
+    if ((ok & (1<<WTLS)) != 0) lk_freetls(S->worker_index);
     if ((ok & (1<<TLS)) != 0) lk_freetls(S->tls_index);
     allocf(ud, S, 0, sizeof(lk_State));
     return NULL;
@@ -1850,7 +4933,7 @@ LK_API lk_State *lk_newstate (const char *name, lk_Allocf *allocf, void *ud) {
 LK_API void lk_close (lk_State *S) {
     lk_Context *ctx = lk_context(S);
     lk_Service *svr = ctx && ctx->current ? ctx->current->service : NULL;
-    if (ctx == NULL && S && S->nservices == 0)
+    if (ctx == NULL && S && lk_atomicload(&S->nservices) == 0)
         lkG_delstate(S);
     else if (svr != NULL && !lkP_isdead(svr)) {
         lk_Signal sig = LK_RESPONSE;
@@ -1867,20 +4950,72 @@ LK_API void lk_close (lk_State *S) {
     }
 }
 
+static void lkG_prewarm (lk_State *S) {
+    static const char *kinds[LK_RESERVE_PIECES] = {
+        "services", "slots", "polls", "defers", "signals", "sources"
+    };
+    char key[64];
+    int i, count;
+    for (i = 0; i < LK_RESERVE_PIECES; ++i) {
+        sprintf(key, "loki.reserve.%s", kinds[i]);
+        if ((count = lkG_configint(S, key, 0)) > 0)
+            lk_reserve(S, i, (size_t)count);
+    }
+    for (i = 0; i < LK_SIZECLASSES; ++i) {
+        sprintf(key, "loki.reserve.pieces.%u", (unsigned)lkM_classsize[i]);
+        if ((count = lkG_configint(S, key, 0)) > 0)
+            lk_reserve(S, LK_RESERVE_PIECE(lkM_classsize[i]
+                        - sizeof(lk_BlockHead)), (size_t)count);
+    }
+}
+
 LK_API int lk_start (lk_State *S, int threads) {
-    int i, count = 0;
+    int i, j, count = 0;
     if (S == NULL) return 0;
-    if (S->nthreads > 0) return S->nthreads;
+    if (lk_atomicload(&S->nthreads) > 0) return (int)S->nthreads;
     lkS_callinitGS(S, &S->root, S->root.slot.handler, S->root.slot.userdata);
     if (S->root.slot.handler == NULL)
-        ++S->nservices;
+        (void)lk_atomicinc(&S->nservices);
     count = threads <= 0 ? lk_cpucount() : threads;
+    if (count > LK_MAX_THREADS) count = LK_MAX_THREADS;
+    S->steal = lkG_configint(S, "loki.steal", 1);
+    S->runnext = lkG_configint(S, "loki.runnext", 1);
+    S->aging_ns = (unsigned long)lkG_configint(S, "loki.priority.aging", 10)
+        * 1000000UL;
+    S->outbox = lkG_configint(S, "loki.outbox", 0);
+    S->waitstats = lkG_configint(S, "loki.waitstats", 0);
+    i = lkG_configint(S, "loki.spin", lk_cpucount() > 1 ? LK_SPIN_US : 0);
+    S->spin_ns = i > 0 ? (unsigned long)i * 1000UL : 0;
+    i = lkG_configint(S, "loki.stacksize", LK_STACK_SIZE);
+    S->stacksize = (size_t)(i > LK_MIN_STACKSIZE ? i : LK_MIN_STACKSIZE);
+    S->trim_interval = lkG_configint(S, "loki.trim.interval", 0);
+    S->trim_high = lkG_configint(S, "loki.trim.high", 100);
+    S->trim_low  = lkG_configint(S, "loki.trim.low", 25);
+    S->lasttrim  = (long)lkT_clock();
+    if ((i = lkG_configint(S, "loki.pool.pagesize", 0)) > 0
+            || lkG_configint(S, "loki.pool.hugepage", 0)) {
+        unsigned flags = lkG_configint(S, "loki.pool.hugepage", 0) ?
+            LK_POOL_HUGEPAGE : 0;
+        lk_setpagesize(S, i > 0 ? (size_t)i : LK_HUGEPAGESIZE, flags);
+    }
+    lkG_prewarm(S);
     for (i = 0; i < count; ++i) {
-        if (!lk_initthread(&S->threads[i], lkG_worker, S))
+        lk_Worker *w = &S->workers[i];
+        w->S     = S;
+        w->index = i;
+        w->spin_ns = S->spin_ns;
+        for (j = 0; j < LK_PRIORITIES; ++j)
+            lkQ_init(&w->queue.q[j]);
+        w->queue.count = 0;
+        if (!lk_initlock(&w->lock))
             break;
     }
-    S->nthreads = i;
-    lk_unlock(S->lock);
+    S->nworkers = count = i;
+    for (i = 0; i < count; ++i) {
+        if (!lk_initthread(&S->threads[i], lkG_worker, &S->workers[i]))
+            break;
+    }
+    lk_atomicstore(&S->nthreads, i); /* the workers read it already */
     return i;
 }
 
@@ -1898,14 +5033,14 @@ LK_API void lk_waitclose (lk_State *S) {
     if (S != NULL) {
         int i;
 #ifdef _WIN32
-        WaitForMultipleObjects(S->nthreads, S->threads, TRUE, INFINITE);
+        WaitForMultipleObjects((DWORD)S->nthreads, S->threads, TRUE, INFINITE);
         for (i = 0; i < S->nthreads; ++i)
             lk_freethread(S->threads[i]);
 #else
         for (i = 0; i < S->nthreads; ++i)
             pthread_join(S->threads[i], NULL);
 #endif
-        S->nthreads = 0; /* not in win32: we should call CloseHandle() on win32 */
+        lk_atomicstore(&S->nthreads, 0); /* not in win32: we should call CloseHandle() on win32 */
     }
 }
 
@@ -139,7 +139,7 @@ LK_API int lk_loadverror (lk_Loader *loader, const char *msg, va_list l) {
 LK_API lk_Data *lk_searchpath (lk_Loader *loader, const char *paths, const char *name) {
     lk_Buffer B;
     while (*paths != '\0') {
-        lk_initbuffer(loader->S, &B);
+        lk_inittmpbuffer(loader->S, &B);
         for (; *paths != '\0' && *paths != ';'; ++paths) {
             if (*paths == '!')
                 lk_adddata(&B, loader->binpath);
@@ -114,7 +114,7 @@ static void lkX_settime (lk_Dumper* dumper, int interval) {
 static void lkX_createdirs (lk_State *S, const char *path) {
     const char *i, *last;
     lk_Buffer B;
-    lk_initbuffer(S, &B);
+    lk_inittmpbuffer(S, &B);
     for (i = last = path; i != '\0'; last = ++i) {
         while (*i != '\0' && *i != '/' && *i != '\\')
             lk_addchar(&B, *i++);
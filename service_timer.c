@@ -228,20 +228,17 @@ static lk_TimerState *lkX_newstate (lk_State *S) {
 }
 
 static int lkX_poller (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
-    lk_TimerState *ts = (lk_TimerState*)lk_data(sender);
+    lk_TimerState *ts = (lk_TimerState*)lk_data(lk_current(S));
     lk_Time nexttime, current;
-    for (;;) {
-        int waittime;
+    if (sender != NULL) {
         lk_lock(ts->lock);
         lkX_updatetimers(ts, current = lk_time());
         nexttime = ts->nexttime;
         assert(nexttime > current);
         lk_unlock(ts->lock);
-        waittime = nexttime == LK_FOREVER ? -1
-            : (int)(nexttime - current);
-        if (lk_wait(S, sig, waittime) == LK_ERR)
-            break;
+        return nexttime == LK_FOREVER ? 0 : (int)(nexttime - current);
     }
+    (void)sig; /* closing */
     ts->nexttime = LK_FOREVER;
     lk_freepool(S, &ts->timers);
     lk_freelock(ts->lock);
@@ -267,7 +264,7 @@ LKMOD_API int loki_service_timer (lk_State *S, lk_Slot *sender, lk_Signal *sig)
     if (sender == NULL) {
         lk_TimerState *ts = lkX_newstate(S);
         lk_Service *svr = lk_self(S);
-        ts->poll = lk_newpoll(S, "poll", lkX_poller, ts);
+        ts->poll = lk_neweventpoll(S, "poll", lkX_poller, ts);
         lk_setrefactor((lk_Slot*)svr, lkX_refactor);
         lk_setdata((lk_Slot*)svr, ts);
         return LK_WEAK;
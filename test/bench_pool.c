@@ -0,0 +1,141 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+
+#include <stdio.h>
+
+#define NPRODUCERS 16
+
+static lk_Lock memlock;
+static size_t  totalmem, peakmem, nallocs;
+static int     nmessages, nbacklog, received, useinline;
+static size_t  trimmed;
+static lk_Slot *sink;
+
+static double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *count_allocf (void *ud, void *ptr, size_t size, size_t osize) {
+    (void)ud;
+    lk_lock(memlock);
+    totalmem += size;
+    totalmem -= osize;
+    if (totalmem > peakmem) peakmem = totalmem;
+    if (size != 0) ++nallocs;
+    lk_unlock(memlock);
+    if (size == 0) { free(ptr); return NULL; }
+    return realloc(ptr, size);
+}
+
+static size_t msgsize (unsigned *seed) {
+    /* mostly small messages with a tail of larger ones */
+    unsigned r = (*seed = *seed * 1103515245 + 12345) >> 8;
+    switch (r % 8) {
+    case 0: return 200 + r % 300;
+    case 1: return 64 + r % 136;
+    default: return 8 + r % 56;
+    }
+}
+
+static int on_stop (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int on_message (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    if (++received == nmessages * NPRODUCERS + nbacklog) {
+        lk_Signal stop = LK_SIGNAL;
+        trimmed = lk_trimpools(S);
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static void produce (lk_State *S, unsigned seed, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        size_t size = msgsize(&seed);
+        lk_Data *data;
+        if (useinline && size <= LK_INLINE_SIZE) {
+            char buff[LK_INLINE_SIZE];
+            memset(buff, 'x', size);
+            lk_emitinline(sink, 0, buff, size);
+            continue;
+        }
+        data = lk_newdata(S, size);
+        memset(data, 'x', size);
+        lk_setlen(data, size);
+        lk_emitdata(sink, 0, data);
+    }
+}
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    produce(S, (unsigned)(ptrdiff_t)lk_userdata(S), nmessages);
+    return LK_OK;
+}
+
+static int loki_service_producer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        lk_emit(lk_newslot(S, "start", on_start, lk_userdata(S)), &start);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static int loki_service_sink (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        sink = lk_newslot(S, "message", on_message, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    lk_State *S;
+    size_t basemem;
+    double start;
+    int i;
+    nmessages = argc > 1 ? atoi(argv[1]) : 100000;
+    nbacklog  = nmessages;
+    useinline = argc > 3 && strcmp(argv[3], "inline") == 0;
+    (void)lk_initlock(&memlock);
+    S = lk_newstate(NULL, count_allocf, NULL);
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "sink", loki_service_sink, NULL);
+    for (i = 0; i < NPRODUCERS; ++i) {
+        char name[32];
+        sprintf(name, "producer%d", i);
+        lk_launch(S, name, loki_service_producer, (void*)(ptrdiff_t)(i + 1));
+    }
+    /* a backlog queued before the workers start measures the memory
+     * cost of a queued message independent of scheduling */
+    basemem = totalmem;
+    produce(S, 0, nbacklog);
+    basemem = totalmem - basemem;
+    start = now();
+    lk_start(S, threads);
+    lk_waitclose(S);
+    start = now() - start;
+    lk_close(S);
+    printf("messages: %d, threads: %d%s\n", nmessages * NPRODUCERS, threads,
+            useinline ? ", inline payloads" : "");
+    printf("backlog: %.1f bytes per queued message\n",
+            (double)basemem / nbacklog);
+    printf("throughput: %.0f msg/s\n", nmessages * NPRODUCERS / start);
+    printf("peak memory: %.1f KB, allocf calls: %lu, leaked: %lu\n",
+            peakmem / 1024.0, (unsigned long)nallocs, (unsigned long)totalmem);
+    printf("trimmed after drain: %.1f KB\n", trimmed / 1024.0);
+    return 0;
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
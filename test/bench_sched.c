@@ -0,0 +1,138 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+
+#include <stdio.h>
+
+#define NSERVICES 64
+#define NTOKENS   256
+
+static lk_Slot *ring[NSERVICES];
+static int      nring;
+static lk_Lock  live_lock;
+static int      live;
+
+static double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int on_stop (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int on_token (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int index = (int)(ptrdiff_t)lk_userdata(S);
+    ptrdiff_t hops = (ptrdiff_t)sig->data;
+    (void)sender;
+    if (hops == 0) {
+        int rest;
+        lk_lock(live_lock);
+        rest = --live;
+        lk_unlock(live_lock);
+        if (rest == 0) {
+            lk_Signal stop = LK_SIGNAL;
+            lk_broadcast(S, "stop", &stop);
+        }
+        return LK_OK;
+    }
+    sig->data = (void*)(hops - 1);
+    lk_emit(ring[(index + 1) % nring], sig);
+    return LK_OK;
+}
+
+static int loki_service_ring (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "token", on_token, lk_userdata(S));
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static size_t waits[LK_PRIORITIES][2];
+
+static const char *spin; /* NULL: the default */
+
+static double run (const char *steal, const char *runnext,
+                   int services, int tokens, int threads, int hops) {
+    lk_State *S = lk_newstate(NULL, NULL, NULL);
+    double start;
+    int i;
+    lk_setconfig(S, "loki.steal", steal);
+    lk_setconfig(S, "loki.runnext", runnext);
+    lk_setconfig(S, "loki.waitstats", "1");
+    if (spin != NULL) lk_setconfig(S, "loki.spin", spin);
+    lk_newslot(S, "stop", on_stop, NULL);
+    nring = services;
+    for (i = 0; i < services; ++i) {
+        char name[32];
+        if (waits[0][0] != 0) { /* one in eight is latency critical */
+            sprintf(name, "loki.priority.ring%d", i);
+            lk_setconfig(S, name, i % 8 == 0 ? "0" : "2");
+        }
+        sprintf(name, "ring%d", i);
+        lk_launch(S, name, loki_service_ring, (void*)(ptrdiff_t)i);
+        sprintf(name, "ring%d.token", i);
+        ring[i] = lk_slot(S, name);
+    }
+    live = tokens;
+    for (i = 0; i < tokens; ++i) {
+        lk_Signal sig = LK_SIGNAL;
+        sig.data = (void*)(ptrdiff_t)hops;
+        lk_emit(ring[i % services], &sig);
+    }
+    start = now();
+    lk_start(S, threads);
+    lk_waitclose(S);
+    start = now() - start;
+    for (i = 0; i < LK_PRIORITIES; ++i)
+        (void)lk_waitstats(S, i, &waits[i][0], &waits[i][1]);
+    lk_close(S);
+    return (double)tokens * hops / start;
+}
+
+int main (int argc, char **argv) {
+    int threads[] = { 1, 2, 4, 8, 16, 32 };
+    int hops = argc > 1 ? atoi(argv[1]) : 10000;
+    size_t i;
+    (void)lk_initlock(&live_lock);
+    printf("threads   main_queue(hops/s)   work-stealing(hops/s)\n");
+    for (i = 0; i < sizeof(threads)/sizeof(threads[0]); ++i) {
+        double global = run("0", "0", NSERVICES, NTOKENS, threads[i], hops);
+        double steal  = run("1", "0", NSERVICES, NTOKENS, threads[i], hops);
+        printf("%7d   %18.0f   %21.0f\n", threads[i], global, steal);
+    }
+    /* one token bounced between two services: every hop wakes an idle
+     * service, which is what runnext keeps on the sending worker, or
+     * a worker spinning before it parks picks up */
+    printf("\nping-pong round trip latency\n");
+    printf("threads   queued(us)   runnext(us)   spin 50us(us)\n");
+    for (i = 0; i < sizeof(threads)/sizeof(threads[0]); ++i) {
+        double queued, runnext, spun;
+        spin = "0";
+        queued  = run("1", "0", 2, 1, threads[i], hops * 10);
+        runnext = run("1", "1", 2, 1, threads[i], hops * 10);
+        spin = "50";
+        spun    = run("1", "0", 2, 1, threads[i], hops * 10);
+        spin = NULL;
+        printf("%7d   %10.3f   %11.3f   %13.3f\n", threads[i],
+                2e6 / queued, 2e6 / runnext, 2e6 / spun);
+    }
+    /* the same ring with every eighth service in the high class */
+    printf("\nqueue wait per class, 4 threads (avg/max us)\n");
+    (void)run("1", "1", NSERVICES, NTOKENS, 4, hops);
+    printf("one class     normal %8.1f / %8.1f\n",
+            waits[1][0] / 1e3, waits[1][1] / 1e3);
+    waits[0][0] = 1;
+    (void)run("1", "1", NSERVICES, NTOKENS, 4, hops);
+    printf("two classes   high   %8.1f / %8.1f   low %8.1f / %8.1f\n",
+            waits[0][0] / 1e3, waits[0][1] / 1e3,
+            waits[2][0] / 1e3, waits[2][1] / 1e3);
+    return 0;
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,132 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+
+#include <stdio.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+#define NSINKS 64
+
+static lk_Slot *sinks[NSINKS];
+static lk_Lock  live_lock;
+static int      live;
+
+static double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#ifdef __linux__
+static int open_counter (void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size     = sizeof(attr);
+    attr.type     = PERF_TYPE_HW_CACHE;
+    attr.config   = PERF_COUNT_HW_CACHE_DTLB
+                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit  = 1; /* count the worker threads too */
+    attr.exclude_kernel = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counter (int fd) {
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static long read_counter (int fd) {
+    unsigned long value = 0;
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) value = 0;
+    close(fd);
+    return (long)value;
+}
+#else
+static int  open_counter  (void)   { return -1; }
+static void start_counter (int fd) { (void)fd; }
+static long read_counter  (int fd) { (void)fd; return -1; }
+#endif
+
+static int on_stop (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int on_message (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int rest;
+    (void)sender, (void)sig;
+    lk_lock(live_lock);
+    rest = --live;
+    lk_unlock(live_lock);
+    if (rest == 0) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_sink (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "message", on_message, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static void run (const char *title, int huge, int nmessages, int threads) {
+    lk_State *S = lk_newstate(NULL, NULL, NULL);
+    double start;
+    long misses;
+    int i, fd;
+    if (huge) lk_setpagesize(S, LK_HUGEPAGESIZE, LK_POOL_HUGEPAGE);
+    lk_newslot(S, "stop", on_stop, NULL);
+    for (i = 0; i < NSINKS; ++i) {
+        char name[32];
+        sprintf(name, "sink%d", i);
+        lk_launch(S, name, loki_service_sink, NULL);
+        sprintf(name, "sink%d.message", i);
+        sinks[i] = lk_slot(S, name);
+    }
+    /* round robin over the sinks, so every mailbox walks all the pages */
+    live = nmessages;
+    for (i = 0; i < nmessages; ++i) {
+        lk_Signal sig = LK_SIGNAL;
+        lk_emit(sinks[i % NSINKS], &sig);
+    }
+    fd = open_counter();
+    start_counter(fd);
+    start = now();
+    lk_start(S, threads);
+    lk_waitclose(S);
+    start = now() - start;
+    misses = read_counter(fd);
+    lk_close(S);
+    if (misses < 0)
+        printf("%-10s %10.0f msg/s   dTLB misses: n/a\n",
+                title, nmessages / start);
+    else
+        printf("%-10s %10.0f msg/s   dTLB misses: %ld (%.3f per msg)\n",
+                title, nmessages / start, misses, (double)misses / nmessages);
+}
+
+int main (int argc, char **argv) {
+    int nmessages = argc > 1 ? atoi(argv[1]) : 2000000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    (void)lk_initlock(&live_lock);
+    printf("backlog: %d signals, threads: %d\n", nmessages, threads);
+    run("4K pages", 0, nmessages, threads);
+    run("2M pages", 1, nmessages, threads);
+    return 0;
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,83 @@
+#ifndef lk_test_h
+#define lk_test_h
+
+/* scaffold of the test/test_*.c programs, included after loki.h:
+ * - newstate() makes a state whose memory is counted in totalmem, and
+ *   the calls of its allocator taking memory in nallocs;
+ * - on_stop() closes the service it is a slot of;
+ * - on_hold() blocks a worker until release() or 10 s;
+ * - finish() prints errors and leaks and gives the exit status. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static lk_Lock  memlock, holdlock;
+static lk_Event holdevent;
+static size_t   totalmem, nallocs;
+static int      released, errors;
+
+static void *count_allocf (void *ud, void *ptr, size_t size, size_t osize) {
+    (void)ud;
+    lk_lock(memlock);
+    totalmem += size;
+    totalmem -= osize;
+    if (size > osize) ++nallocs;
+    lk_unlock(memlock);
+    if (size == 0) { free(ptr); return NULL; }
+    return realloc(ptr, size);
+}
+
+static lk_State *newstate (void) {
+    static int inited = 0;
+    if (!inited) {
+        (void)lk_initlock(&memlock);
+        (void)lk_initlock(&holdlock);
+        (void)lk_initevent(&holdevent);
+        inited = 1;
+    }
+    return lk_newstate(NULL, count_allocf, NULL);
+}
+
+static void sleepms (int ms) {
+    lk_Lock lock;
+    lk_Event evt;
+    (void)lk_initlock(&lock);
+    (void)lk_initevent(&evt);
+    lk_lock(lock);
+    lk_waitevent(&evt, &lock, ms);
+    lk_unlock(lock);
+    lk_freeevent(evt);
+    lk_freelock(lock);
+}
+
+static int on_stop (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int on_hold (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i;
+    (void)S, (void)sender, (void)sig;
+    lk_lock(holdlock);
+    for (i = 0; !released && i < 10; ++i)
+        lk_waitevent(&holdevent, &holdlock, 1000);
+    if (!released) ++errors;
+    lk_unlock(holdlock);
+    return LK_OK;
+}
+
+static void release (void) {
+    lk_lock(holdlock);
+    released = 1;
+    lk_signal(holdevent);
+    lk_unlock(holdlock);
+}
+
+static int finish (int failed) {
+    (void)sleepms, (void)on_stop, (void)on_hold, (void)release;
+    printf("errors: %d, leaked: %lu\n", errors, (unsigned long)totalmem);
+    return failed || errors != 0 || totalmem != 0;
+}
+
+#endif /* lk_test_h */
@@ -0,0 +1,73 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NSIGNALS 5000 /* queued at once: past LK_BATCH_MAX */
+#define NPLAIN   3000 /* then every NTH is a response, which comes alone */
+#define NTH      100
+
+#define isresponse(i) ((i) >= NPLAIN && (i) % NTH == NTH-1)
+
+static lk_Slot *hold, *items;
+static int      seen, ncalls, nalone, npartial, maxbatch;
+
+/* receiver: busy in hold while the signals queue up behind it */
+
+/* every third call takes half of what it got, which must come again */
+static int on_items (lk_State *S, lk_BatchSignal *sigs, int n) {
+    int i, take = n;
+    if (n > maxbatch) maxbatch = n;
+    if (n > LK_BATCH_MAX) ++errors;
+    if (n == 1 && sigs[0].data.isack) ++nalone;
+    else if (++ncalls % 3 == 0 && n > 1)
+        take = n / 2, ++npartial;
+    for (i = 0; i < take; ++i) {
+        int seq = (int)(ptrdiff_t)sigs[i].data.data;
+        if (seq != seen++) ++errors;
+        if (sigs[i].data.isack != isresponse(seq)) ++errors;
+    }
+    if (seen == NSIGNALS) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return take == n ? LK_OK : take;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        hold  = lk_newslot(S, "hold", on_hold, NULL);
+        items = lk_newbatchslot(S, "items", on_items, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    lk_Signal s = LK_SIGNAL;
+    int i;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "receiver", loki_service_receiver, NULL);
+    lk_start(S, threads < 2 ? 2 : threads); /* hold blocks a worker */
+
+    if (lk_emit(hold, &s) != LK_OK) ++errors;
+    for (i = 0; i < NSIGNALS; ++i) {
+        s.data  = (void*)(ptrdiff_t)i;
+        s.isack = isresponse(i);
+        if (lk_emit(items, &s) != LK_OK) ++errors;
+    }
+    release();
+
+    lk_waitclose(S);
+    lk_close(S);
+    printf("handled: %d, batches: %d, partial: %d, alone: %d, largest: %d\n",
+            seen, ncalls, npartial, nalone, maxbatch);
+    return finish(seen != NSIGNALS || npartial == 0
+        || nalone != (NSIGNALS-NPLAIN)/NTH || maxbatch != LK_BATCH_MAX);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,106 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NSIGNALS 1000
+#define BUDGET   10 /* "loki.budget.signals.counted" */
+#define NSLOW    20
+#define SLOWNS   1000000 /* "loki.budget.ns.slow": one sleep is past it */
+
+static lk_Slot *done, *other;
+static int  nseen[3], yielded = -1, ndone;
+static long exhausted[3];
+
+/* every service gets its signals in order, however its dispatches end;
+ * the last one looks how many of them ran out of budget */
+
+static int on_work (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int id = (int)(ptrdiff_t)lk_data(lk_current(S));
+    int count = id == 2 ? NSLOW : NSIGNALS;
+    (void)sender;
+    if ((int)sig->type != nseen[id]++) ++errors;
+    if (id == 0 && nseen[id] == 1) { /* queued on this worker */
+        lk_Signal s = LK_SIGNAL;
+        if (lk_emit(other, &s) != LK_OK) ++errors;
+    }
+    if (id == 2) sleepms(1);
+    if (nseen[id] == count) {
+        lk_Signal s = LK_SIGNAL;
+        exhausted[id] = (long)lk_exhausted(lk_self(S));
+        if (lk_emit(done, &s) != LK_OK) ++errors;
+    }
+    return LK_OK;
+}
+
+static int loki_service_worker (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "work", on_work, lk_data(&lk_self(S)->slot));
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* other: woken by the first of counted, it runs before counted is done */
+static int on_other (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender, (void)sig;
+    yielded = nseen[0];
+    return LK_OK;
+}
+
+static int loki_service_other (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        other = lk_newslot(S, "other", on_other, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static int on_done (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    if (++ndone == 3) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static void emitall (lk_State *S, const char *name, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        s.type = i;
+        if (lk_emit(lk_slot(S, name), &s) != LK_OK) ++errors;
+    }
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    S = newstate();
+    lk_setconfig(S, "loki.budget.signals.counted", lk_str(BUDGET));
+    lk_setconfig(S, "loki.budget.ns.slow", lk_str(SLOWNS));
+    lk_newslot(S, "stop", on_stop, NULL);
+    done = lk_newslot(S, "done", on_done, NULL);
+    lk_launch(S, "counted", loki_service_worker, (void*)0);
+    lk_launch(S, "free", loki_service_worker, (void*)1);
+    lk_launch(S, "slow", loki_service_worker, (void*)2);
+    lk_launch(S, "other", loki_service_other, NULL);
+    emitall(S, "counted.work", NSIGNALS);
+    emitall(S, "free.work", NSIGNALS);
+    emitall(S, "slow.work", NSLOW);
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("exhausted: %ld counted, %ld free, %ld slow; other ran after %d\n",
+            exhausted[0], exhausted[1], exhausted[2], yielded);
+    /* every dispatch but the last of counted leaves some in the mailbox */
+    return finish(nseen[0] != NSIGNALS || nseen[1] != NSIGNALS
+            || nseen[2] != NSLOW || exhausted[0] != NSIGNALS/BUDGET - 1
+            || exhausted[1] != 0 || exhausted[2] == 0
+            || yielded < 0 || yielded >= NSIGNALS);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,181 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NCALLS  10000
+#define NLOST   100
+#define REPLIED 1 /* the type the refactor of echo gives its replies */
+
+static lk_Lock  countlock;
+static lk_Slot *echo, *drop;
+static int      replies, timeouts, closed, waited, waittimeouts;
+static long     refactored;
+
+/* client and waiter count from different workers */
+static void count (lk_State *S, int *counter) {
+    int done;
+    lk_lock(countlock);
+    ++*counter;
+    done = counter != &errors && replies == NCALLS && timeouts == NLOST
+        && waited == NCALLS && waittimeouts == NLOST;
+    lk_unlock(countlock);
+    if (done) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+}
+
+/* server: answers echo, never answers drop; the replies of echo get
+ * their type from its refactor, in the service they go back to */
+
+static int on_refactor (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    if (sender != echo || lk_self(S) == lk_service(echo) || sig->type != 0)
+        count(S, &errors);
+    sig->type = REPLIED;
+    lk_atomicinc(&refactored);
+    return (ptrdiff_t)sig->data % 2 ? LK_OK : LK_ERR; /* either way */
+}
+
+static int on_echo (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S;
+    sig->isack = 1;
+    lk_emit((lk_Slot*)lk_service(sender), sig);
+    return LK_OK;
+}
+
+static int on_drop (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender, (void)sig;
+    return LK_OK;
+}
+
+static int loki_service_server (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        echo = lk_newslot(S, "echo", on_echo, NULL);
+        lk_setrefactor(echo, on_refactor);
+        drop = lk_newslot(S, "drop", on_drop, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* client: callbacks get the reply, or a timeout */
+
+static int on_reply (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    if (sender == NULL || !sig->isack || sig->type != REPLIED
+            || sig->data != sig->source->ud) count(S, &errors);
+    else count(S, &replies);
+    return LK_OK;
+}
+
+static int on_lost (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    if (sender != NULL || sig->source->ud != (void*)&timeouts)
+        count(S, &errors);
+    else count(S, &timeouts);
+    return LK_OK;
+}
+
+static int on_forever (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    if (sender != NULL || sig->source->ud != (void*)&closed)
+        count(S, &errors);
+    else count(S, &closed); /* the client closed with the call pending */
+    return LK_OK;
+}
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i;
+    (void)sender, (void)sig;
+    for (i = 0; i < NCALLS; ++i) {
+        lk_Signal req = LK_SIGNAL;
+        req.data = (void*)(ptrdiff_t)(i + 1);
+        if (lk_call(echo, &req, 5000, on_reply, req.data) != LK_OK)
+            count(S, &errors);
+    }
+    for (i = 0; i < NLOST; ++i) {
+        lk_Signal req = LK_SIGNAL;
+        if (lk_call(drop, &req, 10 + i % 10, on_lost, &timeouts) != LK_OK)
+            count(S, &errors);
+    }
+    {
+        lk_Signal req = LK_SIGNAL;
+        if (lk_call(drop, &req, -1, on_forever, &closed) != LK_OK)
+            count(S, &errors);
+    }
+    return LK_OK;
+}
+
+static int loki_service_client (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    return LK_OK;
+}
+
+/* waiter: coroutine handlers block in lk_call */
+
+static int on_call (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal req = LK_SIGNAL;
+    (void)sender;
+    req.data = sig->data;
+    if (lk_call(echo, &req, 5000, NULL, NULL) != LK_OK || !req.isack
+            || req.type != REPLIED || req.data != sig->data)
+        count(S, &errors);
+    else count(S, &waited);
+    return LK_OK;
+}
+
+static int on_calllost (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal req = LK_SIGNAL;
+    (void)sender, (void)sig;
+    if (lk_call(drop, &req, 10, NULL, NULL) != LK_TIMEOUT) count(S, &errors);
+    else count(S, &waittimeouts);
+    return LK_OK;
+}
+
+static int loki_service_waiter (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Slot *call, *lost;
+        int i;
+        lk_setcoroutine(lk_self(S), 1);
+        lk_newslot(S, "stop", on_stop, NULL);
+        call = lk_newslot(S, "call", on_call, NULL);
+        lost = lk_newslot(S, "lost", on_calllost, NULL);
+        for (i = 0; i < NCALLS; ++i) {
+            lk_Signal s = LK_SIGNAL;
+            s.data = (void*)(ptrdiff_t)(i + 1);
+            lk_emit(call, &s);
+        }
+        for (i = 0; i < NLOST; ++i) {
+            lk_Signal s = LK_SIGNAL;
+            lk_emit(lost, &s);
+        }
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    (void)lk_initlock(&countlock);
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "server", loki_service_server, NULL);
+    lk_launch(S, "client", loki_service_client, NULL);
+    lk_launch(S, "waiter", loki_service_waiter, NULL);
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("replies: %d, timeouts: %d, failed on close: %d\n",
+            replies, timeouts, closed);
+    printf("coroutine replies: %d, timeouts: %d\n", waited, waittimeouts);
+    return finish(replies != NCALLS || timeouts != NLOST
+        || closed != 1 || waited != NCALLS || waittimeouts != NLOST
+        || refactored != 2*NCALLS);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
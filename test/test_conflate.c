@@ -0,0 +1,172 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NKEYS   64
+#define NVALUES 100
+
+static lk_Slot *value, *plain, *latest;
+static int      counts[NKEYS], lasts[NKEYS], order[3], norder;
+static long     ndone;
+
+static void done (lk_State *S) {
+    if (lk_atomicinc(&ndone) == 2) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+}
+
+/* odd keys carry their value in an lk_Data, so replacing frees one */
+static int emitvalue (lk_State *S, lk_Slot *slot, int key, int v) {
+    lk_Signal s = LK_SIGNAL;
+    if (key % 2 != 0)
+        return lk_emitdata(slot, key, lk_newfstring(S, "%d", v));
+    s.type = key;
+    s.data = (void*)(ptrdiff_t)v;
+    return lk_emit(slot, &s);
+}
+
+static int valueof (const lk_Signal *sig) {
+    return sig->isdata ? atoi((const char*)sig->data)
+        : (int)(ptrdiff_t)sig->data;
+}
+
+static size_t keyofvalue (const lk_Signal *sig)
+{ return (size_t)valueof(sig); }
+
+/* receiver: queues every value of every key behind its own handler */
+
+static int on_value (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender;
+    if (sig->type >= NKEYS) ++errors;
+    else {
+        ++counts[sig->type];
+        lasts[sig->type] = valueof(sig);
+    }
+    return LK_OK;
+}
+
+static int on_check (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i;
+    (void)sender, (void)sig;
+    for (i = 0; i < NKEYS; ++i)
+        if (counts[i] != 1 || lasts[i] != NVALUES-1) ++errors;
+    /* nothing queued any more: the key may change */
+    if (lk_setconflate(value, keyofvalue) != LK_OK) ++errors;
+    if (lk_setconflate(value, NULL) != LK_OK) ++errors;
+    done(S);
+    return LK_OK;
+}
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal s = LK_SIGNAL;
+    int i, j;
+    (void)sender, (void)sig;
+    for (j = 0; j < NVALUES; ++j)
+        for (i = 0; i < NKEYS; ++i)
+            if (emitvalue(S, value, i, j) != LK_OK) ++errors;
+    /* the queued values are keyed by type alone */
+    if (lk_setconflate(value, keyofvalue) != LK_ERR) ++errors;
+    /* behind the values in the mailbox */
+    lk_emit(lk_slot(S, "receiver.check"), &s);
+    return LK_OK;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        value = lk_newslot(S, "value", on_value, NULL);
+        if (lk_setconflate(value, NULL) != LK_OK) ++errors;
+        lk_newslot(S, "check", on_check, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    return LK_OK;
+}
+
+/* closer: closes with conflated signals still queued */
+
+static int on_ignore (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender, (void)sig;
+    return LK_OK;
+}
+
+static int on_close (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Slot *slot = lk_slot(S, "closer.value");
+    int i, j;
+    (void)sender, (void)sig;
+    for (j = 0; j < 3; ++j)
+        for (i = 0; i < NKEYS; ++i)
+            if (emitvalue(S, slot, i, j) != LK_OK) ++errors;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int loki_service_closer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        if (lk_setconflate(lk_newslot(S, "value", on_ignore, NULL), NULL)
+                != LK_OK) ++errors;
+        lk_emit(lk_newslot(S, "close", on_close, NULL), &start);
+    }
+    return LK_OK;
+}
+
+/* ordered: a conflated signal skips the outbox, but not what is in it */
+
+static int on_ordered (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    if (norder < 3) order[norder] = (int)(ptrdiff_t)sig->data;
+    if (++norder == 3) {
+        if (order[0] != 0 || order[1] != 1 || order[2] != 2) ++errors;
+        done(S);
+    }
+    return LK_OK;
+}
+
+static int on_emitorder (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal s = LK_SIGNAL;
+    (void)S, (void)sender, (void)sig;
+    s.data = (void*)0; /* buffered in the outbox */
+    if (lk_emit(plain, &s) != LK_OK) ++errors;
+    s.data = (void*)1;
+    if (lk_emit(latest, &s) != LK_OK) ++errors;
+    s.data = (void*)2;
+    if (lk_emit(plain, &s) != LK_OK) ++errors;
+    return LK_OK;
+}
+
+static int loki_service_ordered (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        plain  = lk_newslot(S, "plain", on_ordered, NULL);
+        latest = lk_newslot(S, "latest", on_ordered, NULL);
+        if (lk_setconflate(latest, NULL) != LK_OK) ++errors;
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "emit", on_emitorder, NULL), &start);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    S = newstate();
+    lk_setconfig(S, "loki.outbox", "1");
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "ordered", loki_service_ordered, NULL);
+    lk_launch(S, "closer", loki_service_closer, NULL);
+    lk_launch(S, "receiver", loki_service_receiver, NULL);
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("keys: %d, values each: %d, handled: %d, last value: %d\n",
+            NKEYS, NVALUES, counts[0], lasts[0]);
+    return finish(norder != 3);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,180 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+#ifndef _WIN32
+# include <sys/resource.h>
+#endif
+
+#define NSLEEPS 1000
+
+static lk_Slot *hold, *request;
+static int      nrequests, suspended, maxsuspended, done, slept, nsleeps, lost;
+static int      forever = LK_OK;
+
+static double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* gate: answers nothing until every request is in */
+
+static int on_answer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    static int held;
+    int i;
+    (void)S, (void)sender, (void)sig;
+    if (++held < nrequests) return LK_OK;
+    for (i = 0; i < nrequests; ++i) {
+        lk_Signal resp = LK_RESPONSE;
+        resp.data = (void*)(ptrdiff_t)i;
+        lk_emit(request, &resp);
+    }
+    return LK_OK;
+}
+
+static int loki_service_gate (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        hold = lk_newslot(S, "hold", on_answer, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* client: every handler blocks in lk_wait, none of them holds a thread */
+
+static void emitself (lk_State *S, const char *name, int count) {
+    char buff[64];
+    lk_Slot *slot;
+    sprintf(buff, "client.%s", name);
+    slot = lk_slot(S, buff);
+    while (count-- > 0) {
+        lk_Signal sig = LK_SIGNAL;
+        lk_emit(slot, &sig);
+    }
+}
+
+static int on_request (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal req = LK_SIGNAL;
+    (void)sender;
+    req.data = sig->data;
+    lk_emit(hold, &req);
+    if (++suspended > maxsuspended) maxsuspended = suspended;
+    /* responses come back in request order, to the waiters in order */
+    if (lk_wait(S, sig, -1) != LK_OK || !sig->isack || sig->data != req.data)
+        ++errors;
+    --suspended;
+    if (++done == nrequests) {
+        emitself(S, "sleep", NSLEEPS);
+        emitself(S, "lost", 1);
+    }
+    return LK_OK;
+}
+
+static void sleepdone (lk_State *S) {
+    if (slept == NSLEEPS && lost) {
+        emitself(S, "forever", 1);
+        emitself(S, "finish", 1);
+    }
+}
+
+/* tmpalloc memory outlives the dispatches run while it waits */
+static int *tmpfill (lk_State *S, int id) {
+    int i, *tmp = (int*)lk_tmpalloc(S, 16*sizeof(int));
+    if (tmp == NULL) ++errors;
+    for (i = 0; tmp != NULL && i < 16; ++i) tmp[i] = id;
+    return tmp;
+}
+
+static void tmpcheck (int *tmp, int id) {
+    int i;
+    for (i = 0; tmp != NULL && i < 16; ++i)
+        if (tmp[i] != id) { ++errors; break; }
+}
+
+static int on_sleep (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int id = nsleeps++, *before, *after;
+    (void)sender, (void)sig;
+    before = tmpfill(S, id);
+    if (lk_wait(S, NULL, 5 + id % 10) != LK_TIMEOUT) ++errors;
+    after = tmpfill(S, -id); /* while others still wait */
+    if (lk_wait(S, NULL, 5) != LK_TIMEOUT) ++errors;
+    tmpcheck(before, id);
+    tmpcheck(after, -id);
+    ++slept;
+    sleepdone(S);
+    return LK_OK;
+}
+
+static int on_lost (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    if (lk_wait(S, sig, 20) != LK_TIMEOUT) ++errors;
+    lost = 1;
+    sleepdone(S);
+    return LK_OK;
+}
+
+static int on_forever (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    forever = lk_wait(S, sig, -1); /* until the service closes */
+    return LK_OK;
+}
+
+static int on_finish (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal stop = LK_SIGNAL;
+    (void)sender, (void)sig;
+    lk_broadcast(S, "stop", &stop);
+    lk_close(S);
+    return LK_OK;
+}
+
+static int loki_service_client (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_setcoroutine(lk_self(S), 1);
+        request = lk_newslot(S, "request", on_request, NULL);
+        lk_newslot(S, "sleep", on_sleep, NULL);
+        lk_newslot(S, "lost", on_lost, NULL);
+        lk_newslot(S, "forever", on_forever, NULL);
+        lk_newslot(S, "finish", on_finish, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    lk_State *S;
+    double start;
+    long maxrss = 0;
+    int i;
+    nrequests = argc > 1 ? atoi(argv[1]) : 100000;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "gate", loki_service_gate, NULL);
+    lk_launch(S, "client", loki_service_client, NULL);
+    for (i = 0; i < nrequests; ++i) {
+        lk_Signal sig = LK_SIGNAL;
+        sig.data = (void*)(ptrdiff_t)i;
+        lk_emit(request, &sig);
+    }
+    start = now();
+    lk_start(S, threads);
+    lk_waitclose(S);
+    start = now() - start;
+    lk_close(S);
+#ifndef _WIN32
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) maxrss = usage.ru_maxrss;
+    }
+#endif
+    printf("suspended at once: %d of %d, in %.3f s, max rss: %ld KB\n",
+            maxsuspended, nrequests, start, maxrss);
+    printf("sleeps: %d, lost replies: %d, wait on close: %d\n",
+            slept, lost, forever);
+    return finish(done != nrequests || slept != NSLEEPS
+        || !lost || forever != LK_ERR);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,116 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NRECV    3
+#define NROUNDS  50
+#define NBATCH   40 /* by lk_emitn to one slot, each round */
+#define NEMITV   21 /* by lk_emitv over every slot, each round */
+#define NNULL    3  /* slots of lk_emitv left NULL, each round */
+#define NTOTAL   (NROUNDS*(NBATCH + NEMITV - NNULL))
+
+#define isnull(i) ((i) % 7 == 6)
+
+static lk_Slot *xs[NRECV], *ys[NRECV];
+static unsigned sent[NRECV], next[NRECV];
+static long     received;
+
+/* receivers: both slots of a service see its signals in emit order */
+
+static int on_recv (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int id = (int)(ptrdiff_t)lk_data(lk_current(S));
+    (void)sender;
+    if (sig->type != next[id]++) ++errors;
+    if (sig->isdata && strcmp((const char*)sig->data, "payload") != 0)
+        ++errors;
+    if (lk_atomicinc(&received) == NTOTAL) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        void *id = lk_data(&lk_self(S)->slot);
+        xs[(ptrdiff_t)id] = lk_newslot(S, "x", on_recv, id);
+        ys[(ptrdiff_t)id] = lk_newslot(S, "y", on_recv, id);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* producer: a round of lk_emitn with one shared lk_Data, then one of
+ * lk_emitv spread over every slot, with holes */
+
+static void emitround (lk_State *S, int round) {
+    lk_Signal sigs[NBATCH > NEMITV ? NBATCH : NEMITV];
+    const lk_Slot *slots[NEMITV];
+    lk_Data *data = lk_newstring(S, "payload");
+    int i, id = round % NRECV;
+    for (i = 0; i < NBATCH; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        s.type   = sent[id]++;
+        s.isdata = 1;
+        s.data   = data;
+        sigs[i] = s;
+    }
+    /* the first signal takes the fresh reference, the others their own */
+    if (lk_emitn(round % 2 ? ys[id] : xs[id], sigs, NBATCH) != NBATCH)
+        ++errors;
+    for (i = 0; i < NEMITV; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        id = (i + round) % NRECV;
+        slots[i] = NULL;
+        if (!isnull(i)) {
+            slots[i] = (i / NRECV) % 2 ? ys[id] : xs[id];
+            s.type = sent[id]++;
+        }
+        sigs[i] = s;
+    }
+    if (lk_emitv(S, slots, sigs, NEMITV) != NEMITV - NNULL) ++errors;
+}
+
+static int on_round (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    emitround(S, (int)sig->type);
+    return LK_OK;
+}
+
+static int loki_service_producer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "round", on_round, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    int i;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    for (i = 0; i < NRECV; ++i) {
+        char name[32];
+        sprintf(name, "receiver%d", i);
+        lk_launch(S, name, loki_service_receiver, (void*)(ptrdiff_t)i);
+    }
+    lk_launch(S, "producer", loki_service_producer, NULL);
+    emitround(S, 0); /* outside a worker: no arena for the scratch */
+    for (i = 1; i < NROUNDS; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        s.type = i;
+        if (lk_emit(lk_slot(S, "producer.round"), &s) != LK_OK) ++errors;
+    }
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("received: %ld of %d\n", received, NTOTAL);
+    return finish(received != NTOTAL);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
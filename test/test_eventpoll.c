@@ -0,0 +1,91 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NPOLLS   256
+#define NSIGNALS 100
+
+static lk_Lock  countlock;
+static lk_Slot *polls[NPOLLS];
+static int      received, timeouts, closed;
+
+static double now (void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* each poll counts its signals, then times out once when they stop */
+static int on_event (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int *count = (int*)lk_data(lk_current(S));
+    int alltimedout = 0;
+    lk_lock(countlock);
+    if (sender == NULL)
+        ++closed;
+    else if (sig != NULL) {
+        ++received;
+        if (++*count > NSIGNALS) ++errors;
+    }
+    else if (*count != NSIGNALS)
+        ++errors;
+    else
+        alltimedout = ++timeouts == NPOLLS;
+    lk_unlock(countlock);
+    if (alltimedout) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return sig != NULL ? 10 : 0;
+}
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i, j;
+    (void)S, (void)sender, (void)sig;
+    for (j = 0; j < NSIGNALS; ++j)
+        for (i = 0; i < NPOLLS; ++i) {
+            lk_Signal s = LK_SIGNAL;
+            if (lk_emit(polls[i], &s) != LK_OK) ++errors;
+        }
+    return LK_OK;
+}
+
+static int loki_service_polls (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    static int counts[NPOLLS];
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        char name[32];
+        int i;
+        for (i = 0; i < NPOLLS; ++i) {
+            sprintf(name, "poll%d", i);
+            polls[i] = lk_neweventpoll(S, name, on_event, &counts[i]);
+            if (polls[i] == NULL) ++errors;
+        }
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    double start;
+    (void)lk_initlock(&countlock);
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "polls", loki_service_polls, NULL);
+    start = now();
+    lk_start(S, threads);
+    lk_waitclose(S);
+    start = now() - start;
+    printf("polls: %d on %d poll workers, signals: %d, in %.3f s\n",
+            NPOLLS, S->npollers, received, start);
+    lk_close(S);
+    printf("timeouts: %d, closed: %d\n", timeouts, closed);
+    return finish(received != NPOLLS * NSIGNALS
+        || timeouts != NPOLLS || closed != NPOLLS);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,92 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NSIGNALS 1000
+#define NTH      50 /* every NTH is too big and goes as an lk_Data */
+
+#define paylen(i)  ((i) % NTH == NTH-1 ? LK_INLINE_SIZE + 10 \
+                                       : (i) % (LK_INLINE_SIZE + 1))
+#define payload(i,j) ((int)(((i)*7 + (j)) & 0xFF))
+
+static lk_Slot *forward, *poll, *items;
+static int      nforwarded, nwaited, seen, maxbatch;
+
+/* every hop sees the bytes and the length it was sent with */
+static void check (const lk_Signal *sig, int i) {
+    const unsigned char *p = (const unsigned char*)sig->data;
+    size_t j, len = paylen(i);
+    if ((int)sig->type != i) ++errors;
+    if (sig->isinline != (len <= LK_INLINE_SIZE)) ++errors;
+    if (sig->isdata == sig->isinline) ++errors;
+    if (lk_len((lk_Data*)sig->data) != len) ++errors;
+    for (j = 0; j < len; ++j)
+        if (p[j] != payload(i, j)) { ++errors; break; }
+}
+
+/* relay: a plain slot forwards the signal as it got it to a poll, which
+ * forwards what lk_wait gave it to a batch slot */
+
+static int on_forward (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender;
+    check(sig, nforwarded++);
+    if (lk_emit(poll, sig) != LK_OK) ++errors;
+    return LK_OK;
+}
+
+static int on_poll (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    while (lk_wait(S, sig, -1) == LK_OK) {
+        check(sig, nwaited++);
+        if (lk_emit(items, sig) != LK_OK) ++errors;
+    }
+    return LK_OK;
+}
+
+static int on_items (lk_State *S, lk_BatchSignal *sigs, int n) {
+    int i;
+    if (n > maxbatch) maxbatch = n;
+    for (i = 0; i < n; ++i)
+        check(&sigs[i].data, seen++);
+    if (seen == NSIGNALS) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_relay (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        forward = lk_newslot(S, "forward", on_forward, NULL);
+        poll    = lk_newpoll(S, "poll", on_poll, NULL);
+        items   = lk_newbatchslot(S, "items", on_items, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    unsigned char buff[LK_INLINE_SIZE + 10];
+    lk_State *S;
+    int i, j;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "relay", loki_service_relay, NULL);
+    for (i = 0; i < NSIGNALS; ++i) {
+        for (j = 0; j < paylen(i); ++j)
+            buff[j] = (unsigned char)payload(i, j);
+        if (lk_emitinline(forward, i, buff, paylen(i)) != LK_OK) ++errors;
+    }
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("forwarded: %d, waited: %d, batched: %d, largest batch: %d\n",
+            nforwarded, nwaited, seen, maxbatch);
+    return finish(nforwarded != NSIGNALS || nwaited != NSIGNALS
+            || seen != NSIGNALS);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
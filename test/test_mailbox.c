@@ -0,0 +1,130 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NPRODUCERS 2
+#define NSIGNALS   20000 /* by each producer, and by main */
+#define HIGH       100
+#define LOW        20
+
+static lk_Service *sinksvr;
+static lk_Slot    *sink, *hold;
+static long        received, maxqueued, busy, unblocks;
+static int         sent[NPRODUCERS];
+
+/* sink: never more than HIGH signals queued */
+
+static int on_sink (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    long queued = lk_atomicload(&sinksvr->nqueued);
+    (void)sender, (void)sig;
+    if (queued > maxqueued) maxqueued = queued;
+    if (++received == (NPRODUCERS+1)*NSIGNALS) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_sink (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        sink = lk_newslot(S, "sink", on_sink, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* holder: on_hold blocks a worker, its signal still counted as queued */
+static int loki_service_holder (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        hold = lk_newslot(S, "hold", on_hold, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* producers: send until LK_BUSY, go on when told the sink drained */
+
+static int pump (lk_State *S) {
+    int *count = (int*)lk_data(&lk_self(S)->slot);
+    while (*count < NSIGNALS) {
+        lk_Signal s = LK_SIGNAL;
+        int ret = lk_emit(sink, &s);
+        if (ret == LK_BUSY) {
+            lk_atomicinc(&busy);
+            break;
+        }
+        if (ret != LK_OK) {
+            ++errors;
+            break;
+        }
+        ++*count;
+    }
+    return LK_OK;
+}
+
+static int on_go (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    return pump(S);
+}
+
+static int on_unblock (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    if (sig->type != LK_UNBLOCK_TYPE || sig->isack || !sig->isurgent
+            || sig->data != sinksvr)
+        ++errors;
+    lk_atomicinc(&unblocks);
+    return pump(S);
+}
+
+static int loki_service_producer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal go = LK_SIGNAL;
+        lk_newslot(S, LK_SLOTNAME_UNBLOCK, on_unblock, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "go", on_go, NULL), &go);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    lk_Signal s = LK_SIGNAL;
+    int i, ret;
+    S = newstate();
+    lk_setconfig(S, "loki.mailbox.high.sink", "100");
+    lk_setconfig(S, "loki.mailbox.low.sink", "20");
+    lk_setconfig(S, "loki.mailbox.high.holder", "1");
+    lk_setconfig(S, "loki.mailbox.low.holder", "0");
+    lk_newslot(S, "stop", on_stop, NULL);
+    sinksvr = lk_launch(S, "sink", loki_service_sink, NULL);
+    lk_launch(S, "holder", loki_service_holder, NULL);
+    for (i = 0; i < NPRODUCERS; ++i) {
+        char name[32];
+        sprintf(name, "producer%d", i);
+        lk_launch(S, name, loki_service_producer, &sent[i]);
+    }
+    lk_start(S, threads < 2 ? 2 : threads); /* hold blocks a worker */
+
+    /* a full mailbox: no wait, a timed wait, then a wait until it drains */
+    if (lk_emit(hold, &s) != LK_OK) ++errors;
+    if ((ret = lk_emitwait(hold, &s, 0)) != LK_BUSY) ++errors;
+    if ((ret = lk_emitwait(hold, &s, 20)) != LK_TIMEOUT) ++errors;
+    release();
+    if (lk_emitwait(hold, &s, -1) != LK_OK) ++errors;
+
+    for (i = 0; i < NSIGNALS; ++i)
+        if (lk_emitwait(sink, &s, -1) != LK_OK) ++errors;
+    lk_waitclose(S);
+    lk_close(S);
+    printf("received: %ld, refused: %ld, unblocked: %ld, most queued: %ld\n",
+            received, busy, unblocks, maxqueued);
+    return finish(received != (NPRODUCERS+1)*NSIGNALS
+        || maxqueued > HIGH || busy == 0 || unblocks != busy);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,205 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NMESSAGES 10000
+#define DATASIZE  200
+#define RAWSIZE   5000 /* past the size classes */
+#define NOBJS     100  /* from a pool the producer owns */
+#define NKEPT     100  /* outlive the producer */
+#define QUOTA     20000
+#define NOVER     (2*QUOTA/RAWSIZE) /* blocks that go past it */
+
+static lk_Slot    *items, *check, *poll, *overquota, *probe;
+static lk_Service *producer, *consumer, *quota;
+static lk_MemPool  pool;
+static void       *objs[NOBJS];
+static lk_Data    *kept[NKEPT];
+static long        baseline;
+static int         nkept, nraw, nquota, nprobes;
+static size_t      quotaused;
+
+static long datacharge (void)
+{ return (long)lkM_chargesize(sizeof(lk_Data) + DATASIZE); }
+
+/* producer: allocates, the consumer frees */
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i;
+    (void)sender, (void)sig;
+    for (i = 0; i < NOBJS; ++i)
+        objs[i] = lk_poolalloc(S, &pool);
+    baseline = lk_atomicload(&producer->memused);
+    if (baseline < (long)pool.pagesize) ++errors; /* pages charged here */
+    for (i = 0; i < NMESSAGES; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        lk_Data *data = lk_newdata(S, DATASIZE);
+        if (lk_emitdata(items, 0, data) != LK_OK) ++errors;
+        s.type = 1;
+        s.data = lk_malloc(S, RAWSIZE);
+        if (lk_emit(items, &s) != LK_OK) ++errors;
+    }
+    {
+        lk_Signal end = LK_SIGNAL;
+        end.type = 2;
+        if (lk_emit(items, &end) != LK_OK) ++errors;
+    }
+    return LK_OK;
+}
+
+static int on_check (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    long used = lk_atomicload(&producer->memused);
+    (void)sender, (void)sig;
+    /* all freed by the consumer but the data it keeps */
+    printf("producer: %ld bytes over its baseline, consumer: %lu\n",
+            used - baseline, (unsigned long)lk_memused(consumer));
+    if (used != baseline + NKEPT*datacharge()) ++errors;
+    if (lk_memused(consumer) > 1024) ++errors;
+    lk_close(S);
+    return LK_OK;
+}
+
+static int loki_service_producer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        producer = lk_self(S);
+        lk_initpool(&pool, 64);
+        check = lk_newslot(S, "check", on_check, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    else if (sig == NULL) { /* closing: the consumer still has its data */
+        lk_Signal s = LK_SIGNAL;
+        if (lk_emit(poll, &s) != LK_OK) ++errors;
+    }
+    return LK_OK;
+}
+
+/* consumer: frees what the producer allocated */
+
+static int on_items (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    if (sig->type == 0 && nkept < NKEPT)
+        lk_usedata(S, kept[nkept++] = (lk_Data*)sig->data);
+    else if (sig->type == 1 && ++nraw % 2 == 0)
+        lk_free(S, sig->data, RAWSIZE);
+    else if (sig->type == 1) /* grown here: now ours */
+        lk_free(S, lk_realloc(S, sig->data, RAWSIZE*2, RAWSIZE), RAWSIZE*2);
+    else if (sig->type == 2) {
+        lk_Signal s = LK_SIGNAL;
+        if (lk_emit(check, &s) != LK_OK) ++errors;
+    }
+    return LK_OK;
+}
+
+/* the producer is deleted, but not freed while its data lives */
+static int on_poll (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int i;
+    (void)sender;
+    if (lk_atomicload(&producer->orphan) == 0) {
+        if (lk_emit(poll, sig) != LK_OK) ++errors;
+        return LK_OK;
+    }
+    for (i = 0; i < NOBJS; ++i)
+        lk_poolfree(&pool, objs[i]);
+    lk_freepool(S, &pool); /* its pages go back to the producer */
+    if (lk_memused(producer) != (size_t)(NKEPT*datacharge())) ++errors;
+    if (lk_memused(consumer) > 1024) ++errors;
+    for (i = 0; i < NKEPT; ++i) /* the last one frees the producer */
+        lk_deldata(S, kept[i]);
+    if (lk_emit(overquota, sig) != LK_OK) ++errors;
+    return LK_OK;
+}
+
+static int loki_service_consumer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        consumer = lk_self(S);
+        items = lk_newslot(S, "items", on_items, NULL);
+        poll  = lk_newslot(S, "poll", on_poll, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* quota: told once past its quota; without a handler, it refuses
+ * signals with LK_QUOTA until it is back under */
+
+static void on_quota (lk_State *S, void *ud, lk_Service *svr, size_t used) {
+    (void)S, (void)ud;
+    if (svr != quota) ++errors;
+    ++nquota, quotaused = used;
+}
+
+static void allocover (lk_State *S, void **blocks) {
+    int i;
+    for (i = 0; i < NOVER; ++i)
+        blocks[i] = lk_malloc(S, RAWSIZE);
+}
+
+static void freeover (lk_State *S, void **blocks) {
+    int i;
+    for (i = 0; i < NOVER; ++i)
+        lk_free(S, blocks[i], RAWSIZE);
+}
+
+static int on_overquota (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    size_t base = lk_memused(quota);
+    lk_Signal s = LK_SIGNAL;
+    void *blocks[NOVER];
+    (void)sender, (void)sig;
+    lk_setquota(quota, base + QUOTA, on_quota, NULL);
+    allocover(S, blocks);
+    if (nquota != 1 || quotaused <= base + QUOTA) ++errors;
+    if (lk_emit(probe, &s) != LK_OK) ++errors; /* a handler: still open */
+    freeover(S, blocks); /* back under, but for the queued probe */
+    if (lk_memused(quota) >= base + QUOTA) ++errors;
+    if (lk_mempeak(quota) < base + NOVER*lkM_chargesize(RAWSIZE)) ++errors;
+    lk_setquota(quota, base + QUOTA, NULL, NULL);
+    allocover(S, blocks);
+    if (lk_emit(probe, &s) != LK_QUOTA) ++errors;
+    freeover(S, blocks);
+    if (lk_emit(probe, &s) != LK_OK) ++errors;
+    if (nquota != 1) ++errors;
+    lk_setquota(quota, 0, NULL, NULL);
+    return LK_OK;
+}
+
+static int on_probe (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    if (++nprobes == 2) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_quota (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        quota = lk_self(S);
+        overquota = lk_newslot(S, "over", on_overquota, NULL);
+        probe = lk_newslot(S, "probe", on_probe, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "consumer", loki_service_consumer, NULL);
+    lk_launch(S, "producer", loki_service_producer, NULL);
+    lk_launch(S, "quota", loki_service_quota, NULL);
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("messages: %d, kept past the producer: %d\n", NMESSAGES, nkept);
+    printf("quota crossed: %d, at %lu bytes, probes: %d\n",
+            nquota, (unsigned long)quotaused, nprobes);
+    return finish(nkept != NKEPT || nquota != 1 || nprobes != 2);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,115 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NHELD  100 /* buffered until the handler returns */
+#define NBATCH 10  /* by lk_emitn, after the buffered ones */
+#define NEARLY (LK_OUTBOX_SIZE + 44) /* past the outbox: flushed early */
+#define NEMITV 5
+#define NTOTAL (NHELD + NBATCH + NEARLY + NEMITV)
+
+static lk_Slot *recv, *urgent;
+static long     received, nurgent;
+static int      early;
+
+static int waitfor (long *counter, long count) {
+    int i;
+    for (i = 0; lk_atomicload(counter) < count && i < 1000; ++i)
+        sleepms(1);
+    return lk_atomicload(counter) >= count;
+}
+
+/* receiver: everything arrives once and in emit order */
+
+static int on_recv (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    if ((long)(ptrdiff_t)sig->data != lk_atomicload(&received)) ++errors;
+    if (lk_atomicinc(&received) == NTOTAL) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int on_urgent (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender, (void)sig;
+    lk_atomicinc(&nurgent);
+    return LK_OK;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        recv   = lk_newslot(S, "recv", on_recv, NULL);
+        urgent = lk_newslot(S, "urgent", on_urgent, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* sender: one handler mixing every way to emit */
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal s = LK_SIGNAL, sigs[NBATCH > NEMITV ? NBATCH : NEMITV];
+    const lk_Slot *slots[NEMITV];
+    int i, seq = 0;
+    (void)sender, (void)sig;
+    for (i = 0; i < NHELD; ++i) {
+        s.data = (void*)(ptrdiff_t)seq++;
+        if (lk_emit(recv, &s) != LK_OK) ++errors;
+    }
+    sleepms(50);
+    if (lk_atomicload(&received) != 0) ++errors; /* not buffered */
+    s.isurgent = 1; /* goes out at once */
+    if (lk_emit(urgent, &s) != LK_OK || !waitfor(&nurgent, 1)) ++errors;
+    s.isurgent = 0;
+    for (i = 0; i < NBATCH; ++i) {
+        sigs[i] = s;
+        sigs[i].data = (void*)(ptrdiff_t)seq++;
+    }
+    if (lk_emitn(recv, sigs, NBATCH) != NBATCH) ++errors;
+    for (i = 0; i < NEARLY; ++i) {
+        s.data = (void*)(ptrdiff_t)seq++;
+        if (lk_emit(recv, &s) != LK_OK) ++errors;
+    }
+    /* a full outbox went out before the handler returns */
+    early = waitfor(&received, NHELD + NBATCH + LK_OUTBOX_SIZE);
+    for (i = 0; i < NEMITV; ++i) {
+        slots[i] = recv;
+        sigs[i] = s;
+        sigs[i].data = (void*)(ptrdiff_t)seq++;
+    }
+    if (lk_emitv(S, slots, sigs, NEMITV) != NEMITV) ++errors;
+    return LK_OK;
+}
+
+static int loki_service_sender (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    S = newstate();
+    lk_setconfig(S, "loki.outbox", "1");
+    /* the sender waits in its handler: nothing may wait in its runnext */
+    lk_setconfig(S, "loki.runnext", "0");
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "receiver", loki_service_receiver, NULL);
+    lk_launch(S, "sender", loki_service_sender, NULL);
+    lk_start(S, threads < 2 ? 2 : threads); /* the sender waits on a worker */
+    lk_waitclose(S);
+    lk_close(S);
+    printf("received: %ld, urgent: %ld, flushed early: %d\n",
+            received, nurgent, early);
+    return finish(received != NTOTAL || nurgent != 1 || !early);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
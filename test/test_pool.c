@@ -0,0 +1,217 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NUSERS   4
+#define NROUNDS  50
+#define NREFS    10000 /* use and drop pairs of every round */
+#define NBLOCKS  64    /* sent to the next user every round */
+#define MAXSIZE  (LK_SMALLPIECE_LEN*2) /* past the size classes */
+#define NPAGES   8
+#define PAGESIZE 65536
+
+static lk_Service *owner;
+static lk_Slot    *check, *blocks[NUSERS];
+static lk_Data    *shared;
+static lk_Source   source;
+static long        pending, nevents, ndeleted;
+
+static int fillbyte (size_t size) { return (int)(size * 31 % 251); }
+
+static int filled (const unsigned char *p, size_t len, int c) {
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (p[i] != c) return 0;
+    return 1;
+}
+
+static void done (void) {
+    if (lk_atomicinc(&nevents) == NUSERS*NROUNDS*(NBLOCKS+1)) {
+        lk_Signal s = LK_SIGNAL;
+        if (lk_emit(check, &s) != LK_OK) ++errors;
+    }
+}
+
+/* users: take and drop references at once on every worker, and pass
+ * blocks of every size class to the next user, which frees them */
+
+static int on_round (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int id = (int)(ptrdiff_t)lk_data(lk_current(S)), i;
+    (void)sender;
+    for (i = 0; i < NREFS; ++i) {
+        lk_usedata(S, shared);
+        lk_usesource(&source);
+        if (lk_retain(owner) <= 0) ++errors;
+        if (lk_deldata(S, shared) == 0) ++errors;
+        lk_freesource(&source);
+        (void)lk_release(owner);
+    }
+    for (i = 0; i < NBLOCKS; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        size_t size = ((size_t)sig->type * NBLOCKS + i) * 37 % MAXSIZE + 1;
+        s.type = (unsigned)size;
+        s.data = lk_malloc(S, size);
+        memset(s.data, fillbyte(size), size);
+        if (lk_emit(blocks[(id+1) % NUSERS], &s) != LK_OK) ++errors;
+    }
+    done();
+    return LK_OK;
+}
+
+static int on_block (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    size_t size = sig->type, nsize = size % 3 ? size / 2 + 1 : size * 2;
+    unsigned char *p = (unsigned char*)sig->data;
+    int c = fillbyte(size);
+    (void)sender;
+    if (!filled(p, size, c)) ++errors;
+    p = (unsigned char*)lk_realloc(S, p, nsize, size);
+    if (!filled(p, size < nsize ? size : nsize, c)) ++errors;
+    memset(p, 0, nsize);
+    lk_free(S, p, nsize);
+    done();
+    return LK_OK;
+}
+
+static int loki_service_user (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        void *id = lk_data(&lk_self(S)->slot);
+        blocks[(ptrdiff_t)id] = lk_newslot(S, "block", on_block, NULL);
+        lk_newslot(S, "round", on_round, id);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* owner: holds the first references, drops them when the users are done */
+
+static int on_srcdel (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender, (void)sig;
+    lk_atomicinc(&ndeleted);
+    return LK_OK;
+}
+
+/* objects are chained through their first word, to free them later */
+static void *allocobjs (lk_State *S, lk_MemPool *pool, size_t n, void *objs) {
+    while (n-- != 0) {
+        void **obj = (void**)lk_poolalloc(S, pool);
+        memset(obj, 0xAB, pool->size);
+        *obj = objs, objs = obj;
+    }
+    return objs;
+}
+
+static void freeobjs (lk_MemPool *pool, void *objs) {
+    while (objs != NULL) {
+        void *next = *(void**)objs;
+        lk_poolfree(pool, objs);
+        objs = next;
+    }
+}
+
+/* a pool gives back the pages with no object in use */
+static void check_trim (lk_State *S) {
+    lk_MemPool pool;
+    size_t used = lk_memused(owner), cap, i;
+    void *kept = NULL, *objs = NULL;
+    lk_initpool(&pool, 64);
+    cap = (pool.pagesize - sizeof(lk_PoolPage)) / pool.size;
+    for (i = 0; i < NPAGES; ++i) { /* one object of every page stays */
+        kept = allocobjs(S, &pool, 1, kept);
+        objs = allocobjs(S, &pool, cap - 1, objs);
+    }
+    if (pool.npages != NPAGES) ++errors;
+    if (lk_memused(owner) != used + NPAGES*pool.pagesize) ++errors;
+    freeobjs(&pool, objs);
+    if (lk_trimpool(S, &pool, 0) != 0) ++errors;
+    freeobjs(&pool, kept);
+    if (lk_trimpool(S, &pool, cap) != (NPAGES-1)*pool.pagesize) ++errors;
+    if (pool.npages != 1 || pool.nfree != cap) ++errors;
+    if (lk_trimpool(S, &pool, 0) != pool.pagesize) ++errors;
+    if (pool.npages != 0 || lk_memused(owner) != used) ++errors;
+    lk_freepool(S, &pool);
+}
+
+/* bigger pages, mapped from the OS if it can, are charged the same */
+static void check_pagesize (lk_State *S) {
+    lk_MemPool pool;
+    size_t used = lk_memused(owner), cap;
+    void *objs;
+    lk_initpool(&pool, 64);
+    if (lk_setpoolpage(&pool, 64, 0) != LK_ERR) ++errors; /* too small */
+    if (lk_setpoolpage(&pool, PAGESIZE, LK_POOL_HUGEPAGE) != LK_OK)
+        ++errors;
+    cap = (PAGESIZE - sizeof(lk_PoolPage)) / pool.size;
+    objs = allocobjs(S, &pool, cap + 1, NULL);
+    if (pool.npages != 2 || pool.nobjs != cap*2) ++errors;
+    if (lk_memused(owner) != used + 2*PAGESIZE) ++errors;
+    freeobjs(&pool, objs);
+    if (lk_trimpool(S, &pool, 0) != 2*PAGESIZE) ++errors;
+    if (lk_memused(owner) != used) ++errors;
+    lk_freepool(S, &pool);
+    /* "loki.pool.pagesize" is at least the page of every hot pool */
+    if (S->signals.pagesize != PAGESIZE || S->services.pagesize == PAGESIZE)
+        ++errors;
+}
+
+static int on_check (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal stop = LK_SIGNAL;
+    (void)sender, (void)sig;
+    if (lk_atomicload(&owner->pending) != pending) ++errors;
+    if (lk_deldata(S, shared) != 0) ++errors; /* the last reference */
+    lk_freesource(&source);
+    if (lk_atomicload(&ndeleted) != 1) ++errors;
+    check_trim(S);
+    check_pagesize(S);
+    lk_broadcast(S, "stop", &stop);
+    return LK_OK;
+}
+
+static int loki_service_owner (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        owner = lk_self(S);
+        shared = lk_newstring(S, "shared");
+        lk_usedata(S, shared); /* dropped in on_check */
+        lk_initsource(S, &source, NULL, NULL);
+        source.deletor = on_srcdel;
+        lk_usesource(&source);
+        check = lk_newslot(S, "check", on_check, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    int i, j;
+    S = newstate();
+    lk_setconfig(S, "loki.pool.pagesize", lk_str(PAGESIZE));
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "owner", loki_service_owner, NULL);
+    for (i = 0; i < NUSERS; ++i) {
+        char name[32];
+        sprintf(name, "user%d", i);
+        lk_launch(S, name, loki_service_user, (void*)(ptrdiff_t)i);
+    }
+    pending = lk_atomicload(&owner->pending);
+    for (j = 0; j < NROUNDS; ++j)
+        for (i = 0; i < NUSERS; ++i) {
+            char name[32];
+            lk_Signal s = LK_SIGNAL;
+            sprintf(name, "user%d.round", i);
+            s.type = j;
+            if (lk_emit(lk_slot(S, name), &s) != LK_OK) ++errors;
+        }
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("users: %d, rounds: %d, references: %d, blocks: %d\n",
+            NUSERS, NROUNDS, NUSERS*NROUNDS*NREFS, NUSERS*NROUNDS*NBLOCKS);
+    return finish(lk_atomicload(&nevents) != NUSERS*NROUNDS*(NBLOCKS+1)
+            || ndeleted != 1);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
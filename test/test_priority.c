@@ -0,0 +1,135 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NCLASSES LK_PRIORITIES
+#define AGING    5    /* "loki.priority.aging", ms */
+#define MAXSPIN  5000 /* ms the busy service waits for the starved one */
+
+static const char *names[NCLASSES] = { "high", "normal", "low" };
+static int         order[NCLASSES], nran;
+static lk_Slot    *starved;
+static lk_Nanotime spinstart, waited;
+static long        nspins;
+static int         fed;
+
+/* one worker in both runs, so the order is the scheduler's */
+
+/* ordered: queued in reverse, they run by class */
+
+static int on_run (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    order[nran++] = (int)(ptrdiff_t)lk_data(lk_current(S));
+    if (nran == NCLASSES) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_ordered (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "run", on_run, lk_data(&lk_self(S)->slot));
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static void check_order (void) {
+    lk_State *S = newstate();
+    lk_Service *svr[NCLASSES];
+    int i;
+    lk_setconfig(S, "loki.priority.aging", "0"); /* no overtaking */
+    lk_setconfig(S, "loki.priority.low", lk_str(LK_PRIORITY_LOW));
+    lk_newslot(S, "stop", on_stop, NULL);
+    for (i = NCLASSES-1; i >= 0; --i)
+        svr[i] = lk_launch(S, names[i], loki_service_ordered, (void*)(ptrdiff_t)i);
+    if (lk_setpriority(svr[0], NCLASSES) != LK_ERR) ++errors;
+    if (lk_setpriority(svr[0], LK_PRIORITY_HIGH) != LK_OK) ++errors;
+    for (i = NCLASSES-1; i >= 0; --i) {
+        char name[32];
+        lk_Signal s = LK_SIGNAL;
+        sprintf(name, "%s.run", names[i]);
+        if (lk_emit(lk_slot(S, name), &s) != LK_OK) ++errors;
+    }
+    lk_start(S, 1);
+    lk_waitclose(S);
+    lk_close(S);
+    for (i = 0; i < NCLASSES; ++i)
+        if (order[i] != i) ++errors;
+}
+
+/* busy: a high service always ready to run on the worker it woke a low
+ * one on; only aging lets the low one in */
+
+static int on_busy (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal s = LK_SIGNAL;
+    (void)sender;
+    if (!fed) {
+        fed = 1, spinstart = lkT_nanoclock();
+        if (lk_emit(starved, &s) != LK_OK) ++errors;
+    }
+    if (waited != 0) return LK_OK; /* the starved one ran */
+    if (lkT_nanoclock() - spinstart > (lk_Nanotime)MAXSPIN*1000000) {
+        ++errors;
+        lk_emit(starved, &s);
+        return LK_OK;
+    }
+    ++nspins;
+    return lk_emit(lk_current(S), sig);
+}
+
+static int loki_service_busy (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "busy", on_busy, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static int on_starved (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal stop = LK_SIGNAL;
+    (void)sender, (void)sig;
+    if (waited == 0) waited = lkT_nanoclock() - spinstart;
+    lk_broadcast(S, "stop", &stop);
+    return LK_OK;
+}
+
+static int loki_service_starved (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        starved = lk_newslot(S, "starved", on_starved, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+static void check_aging (void) {
+    lk_State *S = newstate();
+    lk_Signal s = LK_SIGNAL;
+    lk_setconfig(S, "loki.priority.aging", lk_str(AGING));
+    lk_setconfig(S, "loki.priority.busy", lk_str(LK_PRIORITY_HIGH));
+    lk_setconfig(S, "loki.priority.starved", lk_str(LK_PRIORITY_LOW));
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "busy", loki_service_busy, NULL);
+    lk_launch(S, "starved", loki_service_starved, NULL);
+    if (lk_emit(lk_slot(S, "busy.busy"), &s) != LK_OK) ++errors;
+    lk_start(S, 1);
+    lk_waitclose(S);
+    lk_close(S);
+    if (waited < (lk_Nanotime)AGING*1000000 || nspins == 0) ++errors;
+}
+
+int main (void) {
+    check_order();
+    check_aging();
+    printf("order: %s %s %s, starved ran after %lu us and %ld spins\n",
+            names[order[0]], names[order[1]], names[order[2]],
+            (unsigned long)(waited / 1000), nspins);
+    return finish(nran != NCLASSES || waited == 0);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
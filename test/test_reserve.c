@@ -0,0 +1,91 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NPIECES  200
+#define NRESERVE 264 /* NPIECES + LK_MAGAZINE_SIZE: refills take ahead */
+#define SIZE     128 /* a class size: its head moves it up a class */
+#define CFGCLASS 512 /* warmed by "loki.reserve.pieces.512" */
+#define CFGSIZE  (CFGCLASS - sizeof(lk_BlockHead))
+#define COLDSIZE 1000
+
+static void *pieces[NPIECES];
+
+static void allocpieces (lk_State *S, size_t size) {
+    int i;
+    for (i = 0; i < NPIECES; ++i) {
+        pieces[i] = lk_malloc(S, size);
+        memset(pieces[i], i, size);
+    }
+}
+
+static void freepieces (lk_State *S, size_t size) {
+    int i;
+    for (i = 0; i < NPIECES; ++i)
+        lk_free(S, pieces[i], size);
+}
+
+/* user: pieces of the class warmed at lk_start() come from the pool */
+
+static int on_alloc (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_MemPool *pool = &S->smallpieces[lkM_blockclass(CFGSIZE)];
+    lk_Signal stop = LK_SIGNAL;
+    size_t npages;
+    (void)sender, (void)sig;
+    if (lkM_classsize[lkM_blockclass(CFGSIZE)] != CFGCLASS) ++errors;
+    lk_lock(S->pool_lock);
+    npages = pool->npages;
+    if (pool->nobjs < NRESERVE || S->signals.nobjs < NRESERVE) ++errors;
+    lk_unlock(S->pool_lock);
+    allocpieces(S, CFGSIZE);
+    lk_lock(S->pool_lock);
+    if (pool->npages != npages) ++errors;
+    lk_unlock(S->pool_lock);
+    freepieces(S, CFGSIZE);
+    lk_broadcast(S, "stop", &stop);
+    return LK_OK;
+}
+
+static int loki_service_user (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "alloc", on_alloc, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_Signal s = LK_SIGNAL;
+    lk_State *S;
+    size_t n;
+    S = newstate();
+    lk_setconfig(S, "loki.reserve.signals", lk_str(NRESERVE));
+    lk_setconfig(S, "loki.reserve.pieces.512", lk_str(NRESERVE));
+    if (lk_reserve(S, -1, 1) != LK_ERR) ++errors;
+    if (lk_reserve(S, LK_RESERVE_PIECE(LK_SMALLPIECE_LEN), 1) != LK_ERR)
+        ++errors; /* past the size classes with its head */
+
+    /* no worker yet: everything comes straight from the pools */
+    if (lk_reserve(S, LK_RESERVE_PIECE(SIZE), NPIECES) != LK_OK) ++errors;
+    n = nallocs;
+    allocpieces(S, SIZE);
+    if (nallocs != n) ++errors;
+    freepieces(S, SIZE);
+    allocpieces(S, COLDSIZE); /* not reserved: the allocator is called */
+    if (nallocs == n) ++errors;
+    freepieces(S, COLDSIZE);
+
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "user", loki_service_user, NULL);
+    if (lk_emit(lk_slot(S, "user.alloc"), &s) != LK_OK) ++errors;
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("pieces: %d, reserved: %d\n", NPIECES, NRESERVE);
+    return finish(0);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,146 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NPRODUCERS 8
+#define NSIGNALS   20000
+#define NEXTERNAL  20000 /* emitted by main, outside any worker */
+#define TIMEOUT_S  60
+
+static lk_Lock  donelock;
+static lk_Event doneevent;
+static lk_Slot *count, *ticks[NPRODUCERS];
+static int      received[NPRODUCERS+1], minprogress, finished, done;
+
+/* consumer: every signal counted once, in order for each producer */
+
+static int on_count (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int id = sig->type, seq = (int)(ptrdiff_t)sig->data, i;
+    (void)sender;
+    if (id < 0 || id > NPRODUCERS || seq != received[id]) {
+        ++errors;
+        return LK_OK;
+    }
+    if (++received[id] == NSIGNALS && id < NPRODUCERS && !finished) {
+        /* the first producer done: the others must have run as well */
+        finished = 1;
+        minprogress = NSIGNALS;
+        for (i = 0; i < NPRODUCERS; ++i)
+            if (received[i] < minprogress) minprogress = received[i];
+    }
+    for (i = 0; i < NPRODUCERS; ++i)
+        if (received[i] != NSIGNALS) return LK_OK;
+    if (received[NPRODUCERS] == NEXTERNAL) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_consumer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        count = lk_newslot(S, "count", on_count, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* producers: each tick sends one signal and activates itself again */
+
+static int on_tick (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int *sent = (int*)lk_data(lk_current(S));
+    lk_Signal s = LK_SIGNAL;
+    (void)sender;
+    s.type = sig->type;
+    s.data = (void*)(ptrdiff_t)(*sent)++;
+    if (lk_emit(count, &s) != LK_OK) ++errors;
+    if (*sent < NSIGNALS && lk_emit(lk_current(S), sig) != LK_OK)
+        ++errors;
+    return LK_OK;
+}
+
+static int loki_service_producer (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    static int sent[NPRODUCERS];
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        int id = (int)(ptrdiff_t)lk_data(&lk_self(S)->slot);
+        sent[id] = 0;
+        ticks[id] = lk_newslot(S, "tick", on_tick, &sent[id]);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* a hang means a lost wakeup: fail instead of waiting forever */
+static void watchdog (void *ud) {
+    int i;
+    (void)ud;
+    lk_lock(donelock);
+    for (i = 0; !done && i < TIMEOUT_S; ++i)
+        lk_waitevent(&doneevent, &donelock, 1000);
+    lk_unlock(donelock);
+    if (!done) {
+        fprintf(stderr, "timeout: a wakeup was lost\n");
+        exit(1);
+    }
+}
+
+static int run (const char *name, const char *key, int threads) {
+    lk_State *S;
+    int i, ret;
+    memset(received, 0, sizeof(received));
+    minprogress = finished = errors = 0;
+    S = newstate();
+    if (key != NULL) lk_setconfig(S, key, "0");
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "consumer", loki_service_consumer, NULL);
+    for (i = 0; i < NPRODUCERS; ++i) {
+        char pname[32];
+        sprintf(pname, "producer%d", i);
+        lk_launch(S, pname, loki_service_producer, (void*)(ptrdiff_t)i);
+    }
+    lk_start(S, threads);
+    for (i = 0; i < NPRODUCERS; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        s.type = i;
+        lk_emit(ticks[i], &s);
+    }
+    for (i = 0; i < NEXTERNAL; ++i) {
+        lk_Signal s = LK_SIGNAL;
+        s.type = NPRODUCERS;
+        s.data = (void*)(ptrdiff_t)i;
+        if (lk_emit(count, &s) != LK_OK) ++errors;
+        if (i % 2000 == 0) sleepms(1); /* let the workers park */
+    }
+    lk_waitclose(S);
+    lk_close(S);
+    printf("%-10s producers: %d x %d, external: %d, "
+            "least progress when the first one ended: %d\n",
+            name, NPRODUCERS, received[0], received[NPRODUCERS], minprogress);
+    ret = errors != 0 || received[NPRODUCERS] != NEXTERNAL || minprogress == 0;
+    for (i = 0; i < NPRODUCERS; ++i)
+        if (received[i] != NSIGNALS) ret = 1;
+    return ret;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_Thread t;
+    int ret = 0;
+    (void)lk_initlock(&donelock);
+    (void)lk_initevent(&doneevent);
+    lk_initthread(&t, watchdog, NULL);
+    ret |= run("default", NULL, threads);
+    ret |= run("global", "loki.steal", threads);
+    ret |= run("norunnext", "loki.runnext", threads);
+    lk_lock(donelock);
+    done = 1;
+    lk_signal(doneevent);
+    lk_unlock(donelock);
+    lk_waitthread(t);
+    return finish(ret);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,91 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define TIMEOUT 20  /* ms, of the event poll */
+#define BUSY    500 /* ms every worker spends in a handler */
+#define LATE    200 /* ms, waiting for a free worker takes longer */
+
+static lk_Lock  countlock;
+static lk_Slot *poll;
+static long     nbusy, ndone;
+static unsigned emitted, elapsed;
+static int      nthreads, ntimeouts;
+
+/* busy: holds a worker each, until the timeout is long past */
+
+static int on_busy (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender, (void)sig;
+    lk_atomicinc(&nbusy);
+    sleepms(BUSY);
+    if (lk_atomicinc(&ndone) == nthreads) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_busy (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "busy", on_busy, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* ticker: its poll times out on a poll worker, not on a busy one */
+
+static int on_tick (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S;
+    if (sender == NULL) return 0; /* closed */
+    if (sig != NULL) return TIMEOUT;
+    lk_lock(countlock);
+    if (ntimeouts++ == 0) elapsed = lkT_clock() - emitted;
+    lk_unlock(countlock);
+    return 0;
+}
+
+static int loki_service_ticker (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        poll = lk_neweventpoll(S, "tick", on_tick, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    lk_Signal s = LK_SIGNAL;
+    int i;
+    (void)lk_initlock(&countlock);
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "ticker", loki_service_ticker, NULL);
+    for (i = 0; i < threads; ++i) {
+        char name[32];
+        sprintf(name, "busy%d", i);
+        lk_launch(S, name, loki_service_busy, NULL);
+    }
+    nthreads = threads;
+    lk_start(S, threads);
+
+    /* every worker busy, then the poll starts its timeout */
+    lk_broadcast(S, "busy", &s);
+    for (i = 0; lk_atomicload(&nbusy) < threads && i < 1000; ++i)
+        sleepms(1);
+    if (lk_atomicload(&nbusy) < threads) ++errors;
+    emitted = lkT_clock();
+    if (lk_emit(poll, &s) != LK_OK) ++errors;
+
+    lk_waitclose(S);
+    lk_close(S);
+    printf("workers busy: %ld, timeouts: %d, after %u ms (of %d)\n",
+            nbusy, ntimeouts, elapsed, TIMEOUT);
+    return finish(ntimeouts != 1 || elapsed < TIMEOUT || elapsed >= LATE);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
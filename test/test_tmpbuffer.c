@@ -0,0 +1,115 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "../lk_buffer.h"
+#include "lk_test.h"
+
+#define NBYTES  (LK_ARENA_CHUNK*3) /* grows past the arena chunk */
+#define PIECE   100
+
+static lk_Slot *check;
+static size_t   during, grown; /* totalmem while filled, arena grown by */
+
+static size_t used (void) {
+    size_t n;
+    lk_lock(memlock);
+    n = totalmem;
+    lk_unlock(memlock);
+    return n;
+}
+
+static void fill (lk_Buffer *B) {
+    char piece[PIECE];
+    size_t i;
+    for (i = 0; i < NBYTES; i += PIECE) {
+        memset(piece, (int)(i / PIECE % 251), PIECE);
+        lk_addlstring(B, piece, PIECE);
+    }
+}
+
+static int filled (const char *p) {
+    size_t i;
+    for (i = 0; i < NBYTES; ++i)
+        if ((unsigned char)p[i] != i / PIECE % 251) return 0;
+    return 1;
+}
+
+/* scratch: a tmp buffer grows in the arena of the worker */
+
+static int on_fill (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Buffer B;
+    lk_Data *result;
+    lk_Signal s = LK_SIGNAL;
+    size_t before = used();
+    (void)sender, (void)sig;
+    lk_inittmpbuffer(S, &B);
+    fill(&B);
+    if (!B.istmp || B.capacity < NBYTES || lk_buffsize(&B) < NBYTES)
+        ++errors;
+    if (!filled(lk_buffer(&B))) ++errors;
+    during = used();
+    grown = during - before;
+    if (grown < NBYTES) ++errors;
+    result = lk_buffresult(&B); /* a copy the service owns */
+    if (lk_len(result) < NBYTES || !filled((char*)result)) ++errors;
+    lk_deldata(S, result);
+    if (lk_emit(check, &s) != LK_OK) ++errors;
+    return LK_OK;
+}
+
+static int loki_service_scratch (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_newslot(S, "fill", on_fill, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* checker: the arena gives its big chunks back once the dispatch ends,
+ * which may be just after this signal arrives on another worker */
+
+static int on_check (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal stop = LK_SIGNAL;
+    int i;
+    (void)sender, (void)sig;
+    for (i = 0; i < 100 && used() > during - (grown - LK_ARENA_CHUNK); ++i)
+        sleepms(10);
+    if (used() > during - (grown - LK_ARENA_CHUNK)) ++errors;
+    lk_broadcast(S, "stop", &stop);
+    return LK_OK;
+}
+
+static int loki_service_checker (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        check = lk_newslot(S, "check", on_check, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_Signal s = LK_SIGNAL;
+    lk_Buffer B;
+    lk_State *S;
+    S = newstate();
+    /* no arena outside a worker: the buffer owns its storage */
+    lk_inittmpbuffer(S, &B);
+    fill(&B);
+    if (B.istmp || !filled(lk_buffer(&B))) ++errors;
+    lk_freebuffer(&B);
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "scratch", loki_service_scratch, NULL);
+    lk_launch(S, "checker", loki_service_checker, NULL);
+    if (lk_emit(lk_slot(S, "scratch.fill"), &s) != LK_OK) ++errors;
+    lk_start(S, threads);
+    lk_waitclose(S);
+    lk_close(S);
+    printf("tmp buffer: %d bytes, arena grown by %lu\n",
+            NBYTES, (unsigned long)grown);
+    return finish(grown == 0);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
@@ -0,0 +1,156 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NEACH    100
+#define SHORTTTL 20 /* ms, run out while the receiver holds */
+
+enum { SHORT, NEVER, LONG, CLAMPED, NKINDS, HOLD = NKINDS, END };
+
+static lk_Slot *hold, *recv, *forwarded, *check, *relay, *erelay;
+static int      counts[NKINDS], fcounts[NKINDS], nchecks;
+
+/* deadlines are kept in 24 bits: check them across the wrap */
+static void check_wrap (void) {
+    unsigned m = LK_DEADLINE_MASK;
+    if (!lkE_expired(m - 10, 5))        ++errors; /* late across the wrap */
+    if (lkE_expired(5, m - 10))         ++errors; /* ahead across the wrap */
+    if (lkE_expired(100, 100))          ++errors; /* due, not yet late */
+    if (!lkE_expired(100, 101))         ++errors;
+    if (lkE_expired(100, 99))           ++errors;
+    if (!lkE_expired(0, LK_MAX_TTL))    ++errors; /* as late as it gets */
+    if (lkE_expired(0, LK_MAX_TTL + 1)) ++errors; /* further reads as ahead */
+    if (lkE_deadline(0) == 0)           ++errors; /* 0 means no deadline */
+    if (lkE_expired(lkE_deadline(0xFFFFFF), lkT_clock())) ++errors;
+}
+
+/* receiver: busy in hold while the signals queue up behind it */
+
+static int on_recv (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender;
+    if (sig->type >= NKINDS) ++errors;
+    else ++counts[sig->type];
+    return LK_OK;
+}
+
+static int on_forwarded (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender;
+    if (sig->type >= NKINDS) ++errors;
+    else ++fcounts[sig->type];
+    return LK_OK;
+}
+
+/* after main and both polls, which sent it behind all the others */
+static int on_check (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal stop = LK_SIGNAL;
+    (void)sender, (void)sig;
+    if (++nchecks < 3) return LK_OK;
+    if (counts[SHORT] != 0 || counts[NEVER] != NEACH
+            || counts[LONG] != NEACH || counts[CLAMPED] != NEACH)
+        ++errors;
+    if (fcounts[SHORT] != 0 || fcounts[NEVER] != 2*NEACH
+            || fcounts[LONG] != 2*NEACH || fcounts[CLAMPED] != 2*NEACH)
+        ++errors;
+    if (lk_expired(recv) != NEACH || lk_expired(relay) != NEACH
+            || lk_expired(erelay) != NEACH)
+        ++errors;
+    lk_broadcast(S, "stop", &stop);
+    return LK_OK;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        hold  = lk_newslot(S, "hold", on_hold, NULL);
+        recv  = lk_newslot(S, "recv", on_recv, NULL);
+        forwarded = lk_newslot(S, "forwarded", on_forwarded, NULL);
+        check = lk_newslot(S, "check", on_check, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* polls: held like the receiver, then forward what they got; the
+ * handler never sees a deadline, which would read as a ttl */
+
+static void forward (lk_Signal *sig) {
+    int i;
+    if (sig->type == HOLD) {
+        for (i = 0; i < 10000; ++i) {
+            int done;
+            lk_lock(holdlock);
+            done = released;
+            lk_unlock(holdlock);
+            if (done) return;
+            sleepms(1);
+        }
+        ++errors;
+        return;
+    }
+    if (sig->ttl != 0) ++errors;
+    if (lk_emit(sig->type == END ? check : forwarded, sig) != LK_OK)
+        ++errors;
+}
+
+static int on_relay (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sender;
+    while (lk_wait(S, sig, -1) == LK_OK)
+        forward(sig);
+    return LK_OK;
+}
+
+static int on_erelay (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)S, (void)sender;
+    if (sig != NULL) forward(sig);
+    return 0;
+}
+
+static void emitall (const unsigned *ttls) {
+    lk_Slot *slots[3];
+    int i, j, k;
+    slots[0] = recv, slots[1] = relay, slots[2] = erelay;
+    for (i = 0; i < NEACH; ++i)
+        for (j = 0; j < NKINDS; ++j)
+            for (k = 0; k < 3; ++k) {
+                lk_Signal s = LK_SIGNAL;
+                s.type = j;
+                s.ttl  = ttls[j];
+                if (lk_emit(slots[k], &s) != LK_OK) ++errors;
+            }
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    static const unsigned ttls[NKINDS] = { SHORTTTL, 0, LK_MAX_TTL, 0xFFFFFF };
+    lk_State *S;
+    lk_Signal s = LK_SIGNAL;
+    check_wrap();
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    relay  = lk_newpoll(S, "relay", on_relay, NULL);
+    erelay = lk_neweventpoll(S, "erelay", on_erelay, NULL);
+    lk_launch(S, "receiver", loki_service_receiver, NULL);
+    lk_start(S, threads < 2 ? 2 : threads); /* hold blocks a worker */
+
+    if (lk_emit(hold, &s) != LK_OK) ++errors;
+    s.type = HOLD;
+    if (lk_emit(relay, &s) != LK_OK || lk_emit(erelay, &s) != LK_OK)
+        ++errors;
+    emitall(ttls);
+    sleepms(SHORTTTL * 5);
+    release();
+    s.type = END;
+    if (lk_emit(relay, &s) != LK_OK || lk_emit(erelay, &s) != LK_OK)
+        ++errors;
+    if (lk_emit(check, &s) != LK_OK) ++errors;
+
+    lk_waitclose(S);
+    lk_close(S);
+    printf("expired: %d, never: %d, long: %d, clamped: %d, forwarded: %d\n",
+            NEACH - counts[SHORT], counts[NEVER], counts[LONG], counts[CLAMPED],
+            fcounts[NEVER] + fcounts[LONG] + fcounts[CLAMPED]);
+    return finish(0);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */
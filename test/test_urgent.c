@@ -0,0 +1,86 @@
+#define LOKI_IMPLEMENTATION
+#include "../loki.h"
+#include "lk_test.h"
+
+#define NNORMAL 1000
+#define NURGENT 100
+
+static lk_Slot *hold, *recv;
+static int      nnormal, nurgent, overtaken;
+
+/* receiver: busy in hold while both kinds queue up behind it */
+
+static int on_recv (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    int seq = (int)(ptrdiff_t)sig->data;
+    (void)sender;
+    if (sig->isurgent) {
+        if (seq != nurgent++) ++errors;
+        if (nnormal == 0) ++overtaken;
+    }
+    else if (seq != nnormal++)
+        ++errors;
+    if (nnormal == NNORMAL && nurgent == NURGENT) {
+        lk_Signal stop = LK_SIGNAL;
+        lk_broadcast(S, "stop", &stop);
+    }
+    return LK_OK;
+}
+
+static int loki_service_receiver (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        hold = lk_newslot(S, "hold", on_hold, NULL);
+        recv = lk_newslot(S, "recv", on_recv, NULL);
+        lk_newslot(S, "stop", on_stop, NULL);
+    }
+    return LK_OK;
+}
+
+/* sender: all normal signals first, then the urgent ones */
+
+static int on_start (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    lk_Signal s = LK_SIGNAL;
+    int i;
+    (void)S, (void)sender, (void)sig;
+    if (lk_emit(hold, &s) != LK_OK) ++errors;
+    for (i = 0; i < NNORMAL; ++i) {
+        s.data = (void*)(ptrdiff_t)i;
+        if (lk_emit(recv, &s) != LK_OK) ++errors;
+    }
+    s.isurgent = 1;
+    for (i = 0; i < NURGENT; ++i) {
+        s.data = (void*)(ptrdiff_t)i;
+        if (lk_emit(recv, &s) != LK_OK) ++errors;
+    }
+    release();
+    return LK_OK;
+}
+
+static int loki_service_sender (lk_State *S, lk_Slot *sender, lk_Signal *sig) {
+    (void)sig;
+    if (sender == NULL && sig == NULL) {
+        lk_Signal start = LK_SIGNAL;
+        lk_newslot(S, "stop", on_stop, NULL);
+        lk_emit(lk_newslot(S, "start", on_start, NULL), &start);
+    }
+    return LK_OK;
+}
+
+int main (int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    lk_State *S;
+    S = newstate();
+    lk_newslot(S, "stop", on_stop, NULL);
+    lk_launch(S, "receiver", loki_service_receiver, NULL);
+    lk_launch(S, "sender", loki_service_sender, NULL);
+    lk_start(S, threads < 2 ? 2 : threads); /* hold blocks a worker */
+    lk_waitclose(S);
+    lk_close(S);
+    printf("normal: %d, urgent: %d, urgent ahead of all normal: %d\n",
+            nnormal, nurgent, overtaken);
+    return finish(nnormal != NNORMAL || nurgent != NURGENT
+        || overtaken != NURGENT);
+}
+
+/* unixcc: flags+='-O2' libs+='-pthread'
+ * win32cc: flags+='-O2' */